@@ -28,7 +28,6 @@ workspace "QOI"
 	filter { }
 		targetdir ".bin/%{cfg.longname}/"
 		defines { "WIN32", "_AMD64_" }
-		vectorextensions "AVX2"
 
 --debugdir "data"
 
@@ -67,8 +67,15 @@ void *rgba_pixels = qoi_read("image.qoi", &desc, 4);
 This library provides the following functions;
 - qoi_read    -- read and decode a QOI file
 - qoi_decode  -- decode the raw bytes of a QOI image from memory
+- qoi_decode_into -- qoi_decode, into a buffer supplied by the caller
+- qoi_decode_parallel -- qoi_decode, with column strips spread over threads
+- qoi_decode_region -- decode a rectangle of a QOI image into a buffer
+- qoi_index_strips -- find where each column strip of a QOI image starts
 - qoi_write   -- encode and write a QOI file
 - qoi_encode  -- encode an rgba buffer into a QOI image in memory
+- qoi_encode_bound -- the most bytes encoding an image can take
+- qoi_encode_into -- qoi_encode, into a buffer supplied by the caller
+- qoi_encode_parallel -- qoi_encode, with column strips spread over threads
 
 See the function declaration below for the signature and more information.
 
@@ -78,6 +85,16 @@ QOI_NO_STDIO before including this library.
 This library uses malloc() and free(). To supply your own malloc implementation
 you can define QOI_MALLOC and QOI_FREE before including this library.
 
+The parallel functions use pthreads (or Win32 threads). Define QOI_NO_THREADS
+to build without them; the parallel functions then run on the calling thread.
+Threads are started for every call, so each one is given at least
+QOI_THREAD_PIXELS pixels (64K by default, define it to change that) and small
+images are coded on the calling thread alone.
+
+On x86 the pixel transforms use SSE2, AVX2 or AVX-512 kernels, picked at run
+time from what the CPU supports; no compiler flags are needed. Define
+QOI_NO_SIMD to use the portable scalar code only.
+
 
 -- Data Format
 
@@ -87,13 +104,23 @@ struct qoi_header_t {
 	char     magic[4];   // magic bytes "qoif"
 	uint32_t width;      // image width in pixels (BE)
 	uint32_t height;     // image height in pixels (BE)
-	uint8_t  channels;   // must be 3 (RGB) or 4 (RGBA)
-	uint8_t  colorspace; // a bitmap 0000rgba where
+	uint8_t  channels;   // 1 (gray), 3 (RGB) or 4 (RGBA)
+	uint8_t  colorspace; // a bitmap ffffrgba where
 	                     //   - a zero bit indicates sRGBA, 
 	                     //   - a one bit indicates linear (user interpreted)
 	                     //   colorspace for each channel
+	                     //   - ffff are the flags, QOI_STRIP_TABLE = 0x10,
+	                     //   QOI_RESTARTS = 0x20
 };
 
+If QOI_RESTARTS is set, the header is followed by a uint32_t (BE) restart
+interval n: every column strip is split into segments of n chunk rows that
+each start from a reset state.
+
+If QOI_STRIP_TABLE is set, this is followed by one uint32_t (BE) per segment
+(per column strip without restarts): the byte offset of the segment, counted
+from the end of the table.
+
 The decoder and encoder start with {r: 0, g: 0, b: 0, a: 255} as the previous
 pixel value. Pixels are either encoded as
  - a run of the previous pixel
@@ -169,6 +196,43 @@ QOI_COLOR {
 	// if mask is zero, this is not a color but a mode switch (color vs alpha)
 }
 
+QOI_RUN_CHUNK {
+	u8 tag  :  8;   // b11111010
+	// repeats the previous pixel to the end of the current pixel chunk
+}
+
+The pixels are coded in pixel chunks of 16x16, column strip by column strip and
+top to bottom within a strip; the last column and row of chunks take the rest
+of the image, up to 31 pixels. The rows of a pixel chunk run left to right and
+right to left in turn. QOI_RUN_CHUNK fills whatever is left of its pixel chunk,
+however much that is, so a pixel chunk of one new color takes the opcode of its
+first pixel and one byte more.
+
+QOI_RUN_LONG {
+	u8 tag  :  8;   // b11111110
+	u24 run;        // 24-bit run-length (-1) repeating the previous pixel (BE): 0..16777215
+}
+
+Consecutive QOI_RUN_8 bytes form one run, 5 bits each, most significant first.
+The encoder writes runs of more than 1024 pixels, which would take 3 or more,
+as QOI_RUN_LONG instead. Neither kind of run stops at the end of a pixel chunk:
+the pixels left over carry on into the next pixel chunks of the strip, and the
+next opcode codes the pixel after the run. A run never carries past the end of
+a segment.
+
+QOI_RAW {
+	u8 tag  :  8;   // b11111111
+	u8 px[n * 3];   // color mode: the 3 channel values of each of the n pixels
+	                // left in the pixel chunk, in the order QOI_COLOR has them
+	                // BW mode: u8 px[n], the gray value of each pixel
+}
+
+QOI_RAW stores the rest of its pixel chunk as it is; the encoder falls back to
+it for whole pixel chunks whose opcodes would take more bytes. In BW mode,
+where every pixel is gray, the other two channels are 128. The stored pixels
+keep the alpha of the previous pixel and are not put into the color index
+array; the last of them becomes the previous pixel.
+
 The byte stream is padded with 4 zero bytes. Size the longest chunk we can
 encounter is 5 bytes (QOI_COLOR with RGBA set), with this padding we just have 
 to check for an overrun once per decode loop iteration.
@@ -200,6 +264,62 @@ extern "C" {
 #define QOI_SRGB_LINEAR_ALPHA 0x01
 #define QOI_LINEAR 0x0f
 
+// The flags in qoi_desc are stored in the upper 4 bits of the colorspace byte.
+// QOI_STRIP_TABLE makes the encoder write the byte offset of every column strip
+// after the header, so qoi_decode_parallel can hand strips to worker threads.
+
+#define QOI_STRIP_TABLE 0x10
+
+// The channels in qoi_desc are 1 (gray), 3 (RGB) or 4 (RGBA). Gray is coded in
+// BW mode, which has no alpha, so 2 channel (gray + alpha) input is rejected
+// instead of silently losing its alpha. QOI_FORMAT_GRAYA is only an output
+// format.
+
+// A restart_interval of n > 0 in qoi_desc makes the encoder reset its state
+// every n chunk rows, splitting each column strip into segments that can be
+// decoded on their own, so even narrow images spread over threads. The file
+// header then has QOI_RESTARTS set; the encoder sets it by itself.
+
+#define QOI_RESTARTS 0x20
+
+// The stride in qoi_desc is the distance in bytes from one input row to the
+// next for the encoder; 0 means width * channels. With a larger stride, padded
+// framebuffers and rectangles of larger surfaces (pass a pointer to the top
+// left pixel) are encoded in place. The decoder sets it to 0.
+
+// The mode in qoi_desc is no longer used: the encoder picks color or BW mode,
+// where gray pixels are coded as luma deltas, for every chunk from what it
+// holds, and the stream says so. The decoder sets it to 0.
+
+// The layout in qoi_desc gives the order of the channels in an input pixel of
+// `channels` bytes for the encoder. The channels are rearranged as they are
+// loaded, so BGRA captures or masks in the alpha channel need no extra pass.
+// QOI_LAYOUT_ALPHA encodes the alpha byte of RGBA pixels as an opaque gray
+// image. The decoder sets the layout to QOI_LAYOUT_RGBA.
+
+#define QOI_LAYOUT_RGBA  0 // RGB or RGBA, the only layout of 1 channel
+#define QOI_LAYOUT_BGRA  1 // BGR or BGRA
+#define QOI_LAYOUT_ARGB  2 // 4 channels only
+#define QOI_LAYOUT_ALPHA 3 // 4 channels only, alpha as gray
+
+// The decoders take the output pixel format in place of a number of channels:
+// 0 for the channels of the file, 1 to 4 for gray, gray + alpha, RGB or RGBA,
+// or one of the formats below. Each is written straight from the decoded
+// pixels. Gray is the Y channel the codec works with, so it skips the color
+// transform and is exact for gray images. RGB565 pixels are 16 bit words in
+// native byte order. Both drop the alpha channel.
+
+#define QOI_FORMAT_GRAY   0x01
+#define QOI_FORMAT_GRAYA  0x02
+#define QOI_FORMAT_RGB    0x03
+#define QOI_FORMAT_RGBA   0x04
+#define QOI_FORMAT_RGB565 0x12
+#define QOI_FORMAT_BGR    0x13
+#define QOI_FORMAT_BGRA   0x14
+
+// The number of bytes of one pixel in an output format
+#define QOI_FORMAT_SIZE(format) ((format) & 0x0f)
+
 #define QOI_COLOR_CACHE_SIZE 128
 
 typedef struct {
@@ -208,6 +328,10 @@ typedef struct {
 	unsigned char channels;
 	unsigned char colorspace;
 	int mode;
+	int flags;
+	int restart_interval;
+	int stride;
+	int layout;
 } qoi_desc;
 
 typedef struct {
@@ -218,13 +342,15 @@ typedef struct {
 	unsigned int count_run_8;
 	unsigned int count_diff_24;
 	unsigned int count_color;
+	unsigned int count_raw;
 } stats_t;
 
 #ifndef QOI_NO_STDIO
 
 // Encode raw RGB or RGBA pixels into a QOI image and write it to the file 
 // system. The qoi_desc struct must be filled with the image width, height, 
-// number of channels (3 = RGB, 4 = RGBA) and the colorspace. 
+// number of channels (1 = gray, 3 = RGB, 4 = RGBA) and the
+// colorspace. Gray pixels skip the color transform.
 
 // The function returns 0 on failure (invalid parameters, or fopen or malloc 
 // failed) or the number of bytes written on success.
@@ -233,8 +359,9 @@ int qoi_write(const char *filename, const void *data, const qoi_desc *desc);
 
 
 // Read and decode a QOI image from the file system. If channels is 0, the
-// number of channels from the file header is used. If channels is 3 or 4 the
-// output format will be forced into this number of channels.
+// number of channels from the file header is used. If channels is 1 to 4 the
+// output format will be forced into this number of channels. Any other
+// QOI_FORMAT_* selects that output format.
 
 // The function either returns NULL on failure (invalid data, or malloc or fopen
 // failed) or a pointer to the decoded pixels. On success, the qoi_desc struct 
@@ -258,7 +385,38 @@ void *qoi_read(const char *filename, qoi_desc *desc, int channels);
 void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len, stats_t *stats);
 
 
-// Decode a QOI image from memory.
+// Return the most bytes qoi_encode_into can write for an image described by
+// desc: about 3 bytes per pixel, or 1 for gray input (1 channel or
+// QOI_LAYOUT_ALPHA). Returns 0 if desc is invalid.
+
+int qoi_encode_bound(const qoi_desc *desc);
+
+
+// Encode raw RGB or RGBA pixels into a QOI image in the buffer out, which must
+// hold at least qoi_encode_bound(desc) bytes. Nothing is allocated, so the
+// same buffer can be reused for every frame.
+
+// The function returns 0 on failure (invalid parameters or out_size too
+// small) or the size in bytes of the encoded data.
+
+int qoi_encode_into(const void *data, const qoi_desc *desc, void *out, int out_size, stats_t *stats);
+
+
+// Encode raw RGB or RGBA pixels into a QOI image in memory, using up to 
+// `threads` worker threads (0 = one per CPU). Column strips (and restart
+// segments) are independent streams, so they are encoded in parallel and
+// stitched together; the result is byte-identical to qoi_encode. Images of
+// less than 2 * QOI_THREAD_PIXELS pixels are encoded serially.
+
+// Return value and ownership are the same as for qoi_encode.
+
+void *qoi_encode_parallel(const void *data, const qoi_desc *desc, int *out_len, stats_t *stats, int threads);
+
+
+// Decode a QOI image from memory into pixels of the given output format: 0
+// for the channels of the file, or QOI_FORMAT_GRAY, QOI_FORMAT_GRAYA,
+// QOI_FORMAT_RGB, QOI_FORMAT_RGBA (1 to 4), QOI_FORMAT_BGR, QOI_FORMAT_BGRA or
+// QOI_FORMAT_RGB565.
 
 // The function either returns NULL on failure (invalid parameters or malloc 
 // failed) or a pointer to the decoded pixels. On success, the qoi_desc struct 
@@ -266,7 +424,61 @@ void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len, stats_t *
 
 // The returned pixel data should be free()d after use.
 
-void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels);
+void *qoi_decode(const void *data, int size, qoi_desc *desc, int format);
+
+
+// Decode a QOI image from memory straight into the buffer out, with rows
+// out_stride bytes apart (0 = width * pixel size, tightly packed). The padding
+// between rows is left untouched. With out == NULL only the header is read.
+
+// The function returns 0 on failure (invalid parameters or data, or out_stride
+// too small) or the number of bytes the output spans, out_stride * (height -
+// 1) + width * pixel size. On success, the qoi_desc struct is filled with the
+// description from the file header.
+
+int qoi_decode_into(const void *data, int size, qoi_desc *desc, void *out, int out_stride, int format);
+
+
+// Decode a QOI image from memory, using up to `threads` worker threads (0 = one
+// per CPU). Each thread decodes whole column strips or restart segments
+// straight into the output. Images without a strip offset table
+// (QOI_STRIP_TABLE) are indexed with qoi_index_strips first. Broken data, which
+// can't be indexed, is decoded like qoi_decode does it on the calling thread,
+// and so are images of less than 2 * QOI_THREAD_PIXELS pixels.
+
+// Return value and ownership are the same as for qoi_decode.
+
+void *qoi_decode_parallel(const void *data, int size, qoi_desc *desc, int format, int threads);
+
+
+// Decode the rectangle x, y, w, h of a QOI image from memory into the buffer
+// out, which must hold w * h pixels of the output format (rows tightly
+// packed). Only the column strips covering the rectangle are decoded, and
+// each only down to the last chunk row needed. The strips left of the
+// rectangle are skipped through the strip offset table (QOI_STRIP_TABLE) or a
+// quick scan. If that fails on broken data, the strips are decoded in order
+// instead, as far as the data goes.
+
+// The function returns 0 on failure (invalid parameters or data, or the
+// rectangle is not inside the image) or the number of bytes written to out. On
+// success, the qoi_desc struct is filled with the description from the file
+// header.
+
+int qoi_decode_region(const void *data, int size, qoi_desc *desc, int x, int y, int w, int h, void *out, int format);
+
+
+// Find the start of every column strip (or restart segment, strip by strip) of
+// a QOI image in memory. The offsets are counted from the first strip, the
+// same values QOI_STRIP_TABLE stores. Files without a table are scanned by
+// opcode lengths only. For color content that takes about half as long as
+// decoding them, as every opcode is still read in turn; BW chunks, whose delta
+// groups are skipped whole, scan several times faster.
+
+// The function returns 0 on failure (invalid data or more than max_offsets
+// strips) or the number of strips or segments. On success, the qoi_desc struct
+// is filled with the description from the file header.
+
+int qoi_index_strips(const void *data, int size, qoi_desc *desc, unsigned int *offsets, int max_offsets);
 
 
 #ifdef __cplusplus
@@ -280,6 +492,59 @@ void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels);
 
 #ifdef QOI_IMPLEMENTATION
 #include <stdlib.h>
+#include <string.h>
+
+#if !defined(QOI_NO_SIMD) && ( \
+	defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+	#define QOI_X86
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#else
+		#include <cpuid.h>
+	#endif
+#endif
+
+#if defined(__GNUC__)
+	#define QOI_PREFETCH(P) __builtin_prefetch(P)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	#include <xmmintrin.h>
+	#define QOI_PREFETCH(P) _mm_prefetch((const char *)(P), _MM_HINT_T0)
+#else
+	#define QOI_PREFETCH(P)
+#endif
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	#define QOI_BSWAP_32(V) __builtin_bswap32(V)
+	#define QOI_BSWAP_64(V) __builtin_bswap64(V)
+#elif defined(_MSC_VER)
+	#define QOI_BSWAP_32(V) _byteswap_ulong(V)
+	#define QOI_BSWAP_64(V) _byteswap_uint64(V)
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	#define QOI_BSWAP_32(V) (V)
+	#define QOI_BSWAP_64(V) (V)
+#endif
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+	#define QOI_ATOMIC_LOAD_PTR(P) _InterlockedCompareExchangePointer((void *volatile *)(P), NULL, NULL)
+	#define QOI_ATOMIC_STORE_PTR(P, V) _InterlockedExchangePointer((void *volatile *)(P), (void *)(V))
+#else
+	#define QOI_ATOMIC_LOAD_PTR(P) __atomic_load_n(P, __ATOMIC_ACQUIRE)
+	#define QOI_ATOMIC_STORE_PTR(P, V) __atomic_store_n(P, V, __ATOMIC_RELEASE)
+#endif
+
+#ifndef QOI_NO_THREADS
+	#ifdef _WIN32
+		#ifndef WIN32_LEAN_AND_MEAN
+			#define WIN32_LEAN_AND_MEAN
+		#endif
+		#include <windows.h>
+	#else
+		#include <pthread.h>
+		#include <unistd.h>
+	#endif
+#endif
 
 #ifndef QOI_MALLOC
 	#define QOI_MALLOC(sz) (unsigned char *)malloc(sz)
@@ -293,8 +558,11 @@ void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels);
 #define QOI_DIFF_24  0b11110000 // 11110RRR RRRRGGGG GGBBBBBB
 #define QOI_COLOR    0b11111000 // 11111xxx RRRRRRRR GGGGGGGG BBBBBBBB
 #define QOI_COLOR_BW 0b11111001 // 11111001 LLLLLLLL
+#define QOI_RUN_CHUNK 0b11111010 // Repeat the previous pixel to the end of the chunk
 #define QOI_MODE_COL 0b11111100 // Switch to color mode
 #define QOI_MODE_BW  0b11111101 // Switch to BW mode
+#define QOI_RUN_LONG 0b11111110 // 11111110 NNNNNNNN NNNNNNNN NNNNNNNN, a run of N + 1
+#define QOI_RAW      0b11111111 // The rest of the chunk verbatim, YCoCg or (BW mode) Y bytes
 
 #define QOI_MASK_1  0b10000000
 #define QOI_MASK_2  0b11000000
@@ -309,15 +577,23 @@ void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels);
 #define QOI_HEADER_SIZE 14
 #define QOI_PADDING 4
 
+// 2GB is the max file size that this implementation can safely handle. We guard
+// against anything larger than that, assuming the worst case with 5 bytes per
+// pixel, rounded down to a nice clean value. 400 million pixels ought to be
+// enough for anybody.
+#define QOI_PIXELS_MAX ((unsigned int)400000000)
+
 #define QOI_RANGE(value, limit) ((value) >= -(limit) && (value) < (limit))
 
 #define QOI_CHUNK_W 16
 #define QOI_CHUNK_H 16
 #define QOI_SEPARATE_COLUMNS
 #define QOI_STATS(N) stats->N++
+#define QOI_STATS_ADD(N, V) stats->N += (V)
 
 #ifndef QOI_STATS
 	#define QOI_STATS(N)
+	#define QOI_STATS_ADD(N, V)
 #endif
 
 #define QOI_SAVE_COLOR(C) index[QOI_COLOR_HASH(C) % QOI_COLOR_CACHE_SIZE] = C
@@ -346,490 +622,2978 @@ unsigned int qoi_read_32(const unsigned char *bytes, int *p) {
 	return (a << 24) | (b << 16) | (c << 8) | d;
 }
 
-void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len, stats_t *stats) {
-	stats_t empty_stats;
-
-	if (stats == NULL)
-		stats = &empty_stats;
+// Loads 8 bytes as one big-endian word, so the first byte ends up in the top
+// bits. The bytes don't need to be aligned.
+unsigned long long qoi_load_64(const unsigned char *bytes) {
+#ifdef QOI_BSWAP_64
+	unsigned long long v;
+	memcpy(&v, bytes, 8);
+	return QOI_BSWAP_64(v);
+#else
+	unsigned long long v = 0;
+	for (int i = 0; i < 8; i++) {
+		v = (v << 8) | bytes[i];
+	}
+	return v;
+#endif
+}
 
-	memset(stats, 0, sizeof(stats_t));
+// Stores v as 4 or 8 big-endian bytes, the top bits first. The bytes don't
+// need to be aligned.
+void qoi_store_32(unsigned char *bytes, unsigned int v) {
+#ifdef QOI_BSWAP_32
+	v = QOI_BSWAP_32(v);
+	memcpy(bytes, &v, 4);
+#else
+	for (int i = 0; i < 4; i++) {
+		bytes[i] = (unsigned char)(v >> (24 - i * 8));
+	}
+#endif
+}
 
-	if (
-		data == NULL || out_len == NULL || desc == NULL ||
-		desc->width == 0 || desc->height == 0 ||
-		desc->channels < 3 || desc->channels > 4 ||
-		(desc->colorspace & 0xf0) != 0
-	) {
-		return NULL;
+void qoi_store_64(unsigned char *bytes, unsigned long long v) {
+#ifdef QOI_BSWAP_64
+	v = QOI_BSWAP_64(v);
+	memcpy(bytes, &v, 8);
+#else
+	for (int i = 0; i < 8; i++) {
+		bytes[i] = (unsigned char)(v >> (56 - i * 8));
 	}
+#endif
+}
 
-	int max_size = 
-		desc->width * desc->height * (desc->channels + 1) + 
-		QOI_HEADER_SIZE + QOI_PADDING;
+// -----------------------------------------------------------------------------
+// Worker threads
 
-	int p = 0;
-	unsigned char *bytes = QOI_MALLOC(max_size);
-	if (!bytes) {
-		return NULL;
+// Jobs are handed out through a shared counter, so a handful of slow strips
+// doesn't leave the other threads idle. The calling thread works as well.
+
+// Starting and joining a thread costs about as much as coding a few thousand
+// pixels, so every thread gets at least this many.
+#ifndef QOI_THREAD_PIXELS
+	#define QOI_THREAD_PIXELS 65536
+#endif
+
+typedef void (*qoi_job_fn)(void *ctx, int job);
+
+typedef struct {
+	qoi_job_fn fn;
+	void *ctx;
+	int count;
+	volatile long next;
+} qoi_jobs_t;
+
+#ifdef QOI_NO_THREADS
+
+int qoi_thread_count(int threads, int jobs, unsigned int pixels) {
+	(void)threads;
+	(void)jobs;
+	(void)pixels;
+	return 1;
+}
+
+void qoi_parallel_for(int count, int threads, qoi_job_fn fn, void *ctx) {
+	(void)threads;
+	for (int i = 0; i < count; i++) {
+		fn(ctx, i);
 	}
+}
 
-	qoi_write_32(bytes, &p, QOI_MAGIC);
-	qoi_write_32(bytes, &p, desc->width);
-	qoi_write_32(bytes, &p, desc->height);
-	bytes[p++] = desc->channels;
-	bytes[p++] = desc->colorspace;
+#else
 
-	const unsigned char *pixels = (const unsigned char *)data;
-	unsigned char chunkLine[2 * QOI_CHUNK_W * 4];
+#define QOI_MAX_THREADS 64
+
+#ifdef _WIN32
+	#define QOI_ATOMIC_INC(P) (InterlockedIncrement(P) - 1)
+#else
+	#define QOI_ATOMIC_INC(P) __atomic_fetch_add(P, 1, __ATOMIC_RELAXED)
+#endif
 
-	qoi_rgba_t index[QOI_COLOR_CACHE_SIZE] = { 0 };
-	int deltas[QOI_COLOR_CACHE_SIZE] = { 0 };
+#ifdef _WIN32
+DWORD WINAPI qoi_worker(LPVOID arg) {
+#else
+void *qoi_worker(void *arg) {
+#endif
+	qoi_jobs_t *jobs = (qoi_jobs_t *)arg;
+	for (;;) {
+		int job = (int)QOI_ATOMIC_INC(&jobs->next);
+		if (job >= jobs->count) {
+			break;
+		}
+		jobs->fn(jobs->ctx, job);
+	}
+	return 0;
+}
 
-	int run = 0;
-	int diffRun = 0;
-	int mode = desc->mode;
-	qoi_rgba_t px_prev = {.rgba = {.r = 0, .g = 0, .b = 0, .a = 255}};
-	qoi_rgba_t px = px_prev;
-	
-	int px_count = desc->width * desc->height;
-	int chunks_x_count = desc->width / QOI_CHUNK_W;
-	int chunks_y_count = desc->height / QOI_CHUNK_H;
-	int channels = desc->channels;
+// Resolves the requested number of threads: 0 or less means one per CPU. The
+// result is clamped to the number of jobs, QOI_MAX_THREADS and one thread per
+// QOI_THREAD_PIXELS of the image.
+int qoi_thread_count(int threads, int jobs, unsigned int pixels) {
+	if (threads <= 0) {
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		threads = (int)info.dwNumberOfProcessors;
+#else
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+	if (threads > jobs) {
+		threads = jobs;
+	}
+	if ((unsigned int)threads > pixels / QOI_THREAD_PIXELS) {
+		threads = (int)(pixels / QOI_THREAD_PIXELS);
+	}
+	if (threads > QOI_MAX_THREADS) {
+		threads = QOI_MAX_THREADS;
+	}
+	return threads < 1 ? 1 : threads;
+}
+
+// Runs count jobs on threads threads (from qoi_thread_count), the calling
+// thread included
+void qoi_parallel_for(int count, int threads, qoi_job_fn fn, void *ctx) {
+	qoi_jobs_t jobs = { fn, ctx, count, 0 };
+	if (threads > count) {
+		threads = count;
+	}
+
+#ifdef _WIN32
+	HANDLE workers[QOI_MAX_THREADS];
+#else
+	pthread_t workers[QOI_MAX_THREADS];
+#endif
+	int started = 0;
 
-	for (int chunk_x = 0; chunk_x < chunks_x_count; chunk_x++) {
-		int x_pixels = QOI_CHUNK_W;
-		if (chunk_x == chunks_x_count - 1) {
-			x_pixels = desc->width - (chunks_x_count - 1) * QOI_CHUNK_W;
+	for (; started < threads - 1; started++) {
+#ifdef _WIN32
+		workers[started] = CreateThread(NULL, 0, qoi_worker, &jobs, 0, NULL);
+		if (!workers[started]) {
+			break;
+		}
+#else
+		if (pthread_create(&workers[started], NULL, qoi_worker, &jobs) != 0) {
+			break;
 		}
+#endif
+	}
 
-#ifdef QOI_SEPARATE_COLUMNS
-		memset(index, 0, sizeof(qoi_rgba_t) * QOI_COLOR_CACHE_SIZE);
-		memset(deltas, 0, sizeof(int) * QOI_COLOR_CACHE_SIZE);
-		run = 0;
-		px_prev.rgba.r = 0;
-		px_prev.rgba.g = 0;
-		px_prev.rgba.b = 0;
-		px_prev.rgba.a = 255;
-		px = px_prev;
-		mode = desc->mode;
+	qoi_worker(&jobs);
 
-		px_count = x_pixels * desc->height;
+	for (int i = 0; i < started; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(workers[i], INFINITE);
+		CloseHandle(workers[i]);
+#else
+		pthread_join(workers[i], NULL);
 #endif
+	}
+}
 
-		for (int chunk_y = 0; chunk_y < chunks_y_count; chunk_y++) {
-			int y_pixels = QOI_CHUNK_H;
-			if(chunk_y == chunks_y_count - 1) {
-				y_pixels = desc->height - (chunks_y_count - 1) * QOI_CHUNK_H;
-			}
+#endif // QOI_NO_THREADS
 
-			int px_chunk_pos = ((chunk_y * QOI_CHUNK_H) * desc->width) + chunk_x * QOI_CHUNK_W;
-			int bw_pixel_count = 0;
+// -----------------------------------------------------------------------------
+// SIMD kernels
+
+// The per-pixel work that doesn't depend on the opcode stream runs in kernels
+// over a whole chunk: the forward YCoCg transform, run matching and cache
+// hashing in the encoder, and the inverse transform plus store in the decoder.
+// Each kernel has a scalar version and, on x86, SSE2, AVX2 and AVX-512 (F and
+// BW) versions, compiled for their instruction set through target attributes.
+// qoi_get_kernels picks the best set the CPU and OS support from cpuid at
+// first use, so one binary runs everywhere. All versions compute exactly the
+// same values; halving rounds towards zero like the scalar divisions.
+
+// Chunks are converted to YCoCg (r = Y, g = Co, b = Cg) into a tile laid out
+// in serpentine order, so the opcode loops just walk the tile. Alpha is kept
+// as is (255 for RGB input) since it takes part in the run and index
+// comparisons.
+
+// Where the encoder finds each channel in an input pixel: the byte offsets of
+// r, g, b and a (-1 if there is no alpha) in a pixel of `size` bytes.
+typedef struct {
+	int layout;
+	int size;
+	int r, g, b, a;
+} qoi_layout_t;
+
+void qoi_layout_init(qoi_layout_t *l, const qoi_desc *desc) {
+	static const signed char offsets[4][4] = {
+		{ 0, 1, 2, 3 }, // QOI_LAYOUT_RGBA
+		{ 2, 1, 0, 3 }, // QOI_LAYOUT_BGRA
+		{ 1, 2, 3, 0 }, // QOI_LAYOUT_ARGB
+		{ 3, 3, 3, -1 } // QOI_LAYOUT_ALPHA
+	};
+	l->layout = desc->layout;
+	l->size = desc->channels;
+	if (desc->channels == 1) {
+		l->r = l->g = l->b = 0;
+		l->a = -1;
+		return;
+	}
+	l->r = offsets[desc->layout][0];
+	l->g = offsets[desc->layout][1];
+	l->b = offsets[desc->layout][2];
+	l->a = desc->channels == 4 ? offsets[desc->layout][3] : -1;
+}
 
-			for (int y = 0; y < y_pixels; y++, px_chunk_pos += desc->width) {
-				memcpy(chunkLine, pixels + px_chunk_pos * channels, x_pixels * channels);
-				for (int x = 0; x < x_pixels; x++, px_count--) {
-					memcpy(&px_prev, &px, 4);
+// Byte shuffle that gathers 4 consecutive input pixels into RGBA order, with
+// zero for a missing alpha, for the vector kernels that have one.
+void qoi_layout_shuffle(const qoi_layout_t *l, signed char *mask) {
+	for (int i = 0; i < 4; i++) {
+		mask[i * 4 + 0] = (signed char)(i * l->size + l->r);
+		mask[i * 4 + 1] = (signed char)(i * l->size + l->g);
+		mask[i * 4 + 2] = (signed char)(i * l->size + l->b);
+		mask[i * 4 + 3] = (signed char)(l->a >= 0 ? i * l->size + l->a : -1);
+	}
+}
 
-					int x_pos = ((y & 1) ? (x_pixels - x - 1) : x) * channels;
+// Chunk classes, found before a chunk is encoded
+#define QOI_CHUNK_GRAY  1 // every pixel has Co = Cg = 128
+#define QOI_CHUNK_SOLID 2 // every pixel is the same
 
-					if (desc->channels == 4) {
-						memcpy(&px, chunkLine + x_pos, 4);
-					}
-					else {
-						px.rgba.r = chunkLine[x_pos];
-						px.rgba.g = chunkLine[x_pos + 1];
-						px.rgba.b = chunkLine[x_pos + 2];
-					}
+typedef struct {
+	// Converts a w x h chunk at src (rows stride bytes apart) into tile. end
+	// is the end of the image; vector loads never read past it. Only the SSE2
+	// and AVX2 loaders need it, as they load whole vectors: the scalar one
+	// reads pixel by pixel and AVX-512 masks its loads, so they ignore it.
+	void (*ycocg_chunk)(const unsigned char *src, const unsigned char *end, int stride, const qoi_layout_t *layout, int w, int h, qoi_rgba_t *tile);
+
+	// Returns how many pixels at the start of tile (count at most) equal px
+	int (*match_run)(const qoi_rgba_t *tile, int count, qoi_rgba_t px);
+
+	// Fills hashes with the color cache position of every pixel of the tile.
+	// Modulo the cache size of 128 the hash is r * 93 + g * 89 + b * 37 + a,
+	// or r * -35 + g * -39 + b * 37 + a, which fits signed 8-bit factors.
+	void (*hash_tile)(const qoi_rgba_t *tile, int count, unsigned char *hashes);
+
+	// Returns the QOI_CHUNK_* classes count pixels of tile (at least one)
+	// belong to
+	int (*classify_tile)(const qoi_rgba_t *tile, int count);
+
+	// Converts count YCoCg pixels, read from row in steps of inc (1 or -1),
+	// to the output format (QOI_FORMAT_*) and stores them at dst
+	void (*store_rgb)(unsigned char *dst, const qoi_rgba_t *row, int inc, int count, int format);
+
+	// Writes the count (1 to 16) gray pixels of a BW mode delta group to tile,
+	// each the luma of the one before (px for the first) plus a 4-bit delta - 8
+	// from packed, two to a byte with the earlier one in the low nibble. Reads
+	// 8 bytes of packed and may write all 16 pixels.
+	void (*unpack_deltas)(qoi_rgba_t *tile, const unsigned char *packed, int count, qoi_rgba_t px);
+
+	// Writes px to count pixels of tile, and maybe to up to 15 after them
+	void (*fill)(qoi_rgba_t *tile, int count, qoi_rgba_t px);
+
+	// Writes count pixels of a stored chunk to tile, with the alpha of px:
+	// Y, Co and Cg from 3 bytes each, or a gray Y from 1 byte each (size 1).
+	// May read 4 bytes past the last one.
+	void (*load_raw)(qoi_rgba_t *tile, const unsigned char *raw, int count, int size, qoi_rgba_t px);
+} qoi_kernels_t;
+
+qoi_rgba_t qoi_ycocg(const unsigned char *src, const qoi_layout_t *layout) {
+	qoi_rgba_t px;
+	if (layout->size == 1) {
+		// Gray is Y with no chroma
+		px.rgba.r = src[0];
+		px.rgba.g = 128;
+		px.rgba.b = 128;
+		px.rgba.a = 255;
+		return px;
+	}
 
-					int Co = ((int)px.rgba.r - (int)px.rgba.b) / 2 + 128;
-					int tmp = px.rgba.b + (Co - 128) / 2;
-					int Cg = (px.rgba.g - tmp) / 2 + 128;
-					int Y = tmp + (Cg - 128);
+	int r = src[layout->r], g = src[layout->g], b = src[layout->b];
+	int Co = (r - b) / 2 + 128;
+	int tmp = b + (Co - 128) / 2;
+	int Cg = (g - tmp) / 2 + 128;
+	int Y = tmp + (Cg - 128);
+
+	px.rgba.r = Y;
+	px.rgba.g = Co;
+	px.rgba.b = Cg;
+	px.rgba.a = layout->a >= 0 ? src[layout->a] : 255;
+	return px;
+}
 
-					px.rgba.r = Y;
-					px.rgba.g = Co;
-					px.rgba.b = Cg;
+qoi_rgba_t qoi_rgb(qoi_rgba_t px) {
+	qoi_rgba_t rgb;
+	int tmp = (int)px.rgba.r - ((int)px.rgba.b - 128);
+	rgb.rgba.g = 2 * ((int)px.rgba.b - 128) + tmp;
+	rgb.rgba.b = tmp - ((int)px.rgba.g - 128) / 2;
+	rgb.rgba.r = rgb.rgba.b + 2 * ((int)px.rgba.g - 128);
+	rgb.rgba.a = px.rgba.a;
+	return rgb;
+}
 
-					int diffFromPrev = memcmp(&px, &px_prev, 4);
-					int flushRun = 0;
+// Stores a YCoCg pixel in the output format
+void qoi_store_px(unsigned char *dst, qoi_rgba_t px, int format) {
+	if (format == QOI_FORMAT_GRAY || format == QOI_FORMAT_GRAYA) {
+		dst[0] = px.rgba.r;
+		if (format == QOI_FORMAT_GRAYA) {
+			dst[1] = px.rgba.a;
+		}
+		return;
+	}
 
-					if (Co == 128 && Cg == 128) {
-						// Count gray pixels, so we can automatically switch
-						// to BW mode at the end of this chunk
-						++bw_pixel_count;
-					}
-					else if (mode == 1) {
-						// Colored pixel encountered while in BW mode, need to
-						// switch to color mode immediately
-						bytes[p++] = QOI_MODE_COL;
-						mode = 0;
-					}
+	px = qoi_rgb(px);
+	switch (format) {
+		case QOI_FORMAT_RGBA:
+			memcpy(dst, &px, 4);
+			break;
+		case QOI_FORMAT_RGB:
+			dst[0] = px.rgba.r;
+			dst[1] = px.rgba.g;
+			dst[2] = px.rgba.b;
+			break;
+		case QOI_FORMAT_BGRA:
+			dst[3] = px.rgba.a;
+			// fallthrough
+		case QOI_FORMAT_BGR:
+			dst[0] = px.rgba.b;
+			dst[1] = px.rgba.g;
+			dst[2] = px.rgba.r;
+			break;
+		case QOI_FORMAT_RGB565: {
+			unsigned short v = (unsigned short)(
+				((px.rgba.r >> 3) << 11) | ((px.rgba.g >> 2) << 5) | (px.rgba.b >> 3)
+			);
+			memcpy(dst, &v, 2);
+			break;
+		}
+	}
+}
 
-					if (!diffFromPrev) {
-						run++;
-						flushRun = (px_count == 1);
-						QOI_STATS(count_run_8);
+void qoi_ycocg_chunk_scalar(const unsigned char *src, const unsigned char *end, int stride, const qoi_layout_t *layout, int w, int h, qoi_rgba_t *tile) {
+	(void)end;
+	for (int y = 0; y < h; y++, src += stride, tile += w) {
+		for (int x = 0; x < w; x++) {
+			tile[(y & 1) ? w - x - 1 : x] = qoi_ycocg(src + x * layout->size, layout);
+		}
+	}
+}
 
-						if (!flushRun) {
-							continue;
-						}
-					}
-					else {
-						int vr = px.rgba.r - px_prev.rgba.r;
-						if (diffRun > 0 && QOI_RANGE(vr, 8)) {
-							flushRun = 0;
-							run = 0;
-						}
-						else {
-							flushRun = run > 0;
-						}
-					}
+int qoi_match_run_scalar(const qoi_rgba_t *tile, int count, qoi_rgba_t px) {
+	int n = 0;
+	while (n < count && tile[n].v == px.v) {
+		n++;
+	}
+	return n;
+}
 
-					if (flushRun) {
-						int start = p;
-						--run;
-
-						do
-						{
-							bytes[p++] = QOI_RUN_8 | (run & 0x1f);
-							run >>= 5;
-						} while (run > 0);
-
-						// Swap to make big endian
-						int len = (p - start) >> 1;
-						for (int i = 0; i < len; i++)
-						{
-							unsigned char tmp = bytes[start + i];
-							bytes[start + i] = bytes[p - 1 - i];
-							bytes[p - 1 - i] = tmp;
-						}
+void qoi_hash_tile_scalar(const qoi_rgba_t *tile, int count, unsigned char *hashes) {
+	for (int i = 0; i < count; i++) {
+		hashes[i] = QOI_COLOR_HASH(tile[i]) % QOI_COLOR_CACHE_SIZE;
+	}
+}
 
-						run = 0;
-						diffRun = 0;
+int qoi_classify_tile_scalar(const qoi_rgba_t *tile, int count) {
+	unsigned int diff = 0, chroma = 0;
+	for (int i = 0; i < count; i++) {
+		diff |= tile[i].v ^ tile[0].v;
+		chroma |= (tile[i].rgba.g ^ 128) | (tile[i].rgba.b ^ 128);
+	}
+	return (diff ? 0 : QOI_CHUNK_SOLID) | (chroma ? 0 : QOI_CHUNK_GRAY);
+}
 
-						if (!diffFromPrev)
-							continue;
-					}
+// One loop per format, so the format is a constant inside each
+#define QOI_STORE_LOOP(format) \
+	for (int i = 0; i < count; i++, row += inc, dst += QOI_FORMAT_SIZE(format)) { \
+		qoi_store_px(dst, *row, format); \
+	}
 
-					// Color mode
-					if (mode == 0) {
-						int index_pos = QOI_COLOR_HASH(px) % QOI_COLOR_CACHE_SIZE;
-						QOI_STATS(count_hash_bucket[index_pos]);
+void qoi_store_rgb_scalar(unsigned char *dst, const qoi_rgba_t *row, int inc, int count, int format) {
+	switch (format) {
+		case QOI_FORMAT_GRAY: QOI_STORE_LOOP(QOI_FORMAT_GRAY); break;
+		case QOI_FORMAT_GRAYA: QOI_STORE_LOOP(QOI_FORMAT_GRAYA); break;
+		case QOI_FORMAT_RGB: QOI_STORE_LOOP(QOI_FORMAT_RGB); break;
+		case QOI_FORMAT_RGBA: QOI_STORE_LOOP(QOI_FORMAT_RGBA); break;
+		case QOI_FORMAT_BGR: QOI_STORE_LOOP(QOI_FORMAT_BGR); break;
+		case QOI_FORMAT_BGRA: QOI_STORE_LOOP(QOI_FORMAT_BGRA); break;
+		case QOI_FORMAT_RGB565: QOI_STORE_LOOP(QOI_FORMAT_RGB565); break;
+	}
+}
 
-						if (index[index_pos].v == px.v) {
-							bytes[p++] = index_pos;
-							QOI_STATS(count_index);
-						}
-						else {
-							index[index_pos] = px;
-
-							int vr = px.rgba.r - px_prev.rgba.r;
-							int vg = px.rgba.g - px_prev.rgba.g;
-							int vb = px.rgba.b - px_prev.rgba.b;
-
-							// Color mode
-							if (
-								QOI_RANGE(vr, 64) &&
-								QOI_RANGE(vg, 32) && QOI_RANGE(vb, 32)
-								) {
-								if (
-									QOI_RANGE(vr, 2) &&
-									QOI_RANGE(vg, 2) && QOI_RANGE(vb, 2)
-									) {
-									bytes[p++] = QOI_DIFF_8 | ((vr + 2) << 4) | (vg + 2) << 2 | (vb + 2);
-									QOI_STATS(count_diff_8);
-								}
-								else if (
-									QOI_RANGE(vr, 8) &&
-									QOI_RANGE(vg, 8) && QOI_RANGE(vb, 8)
-									) {
-									unsigned int value =
-										(QOI_DIFF_16 << 8) | ((vr + 8) << 8) |
-										((vg + 8) << 4) | (vb + 8);
-									bytes[p++] = (unsigned char)(value >> 8);
-									bytes[p++] = (unsigned char)(value);
-									QOI_STATS(count_diff_16);
-								}
-								else {
-									if (px.rgba.g == 128 && px.rgba.b == 128) {
-										goto encodecolor;
-									}
-
-									unsigned int value =
-										(QOI_DIFF_24 << 16) | ((vr + 64) << 12) |
-										((vg + 32) << 6) | (vb + 32);
-
-									bytes[p++] = (unsigned char)(value >> 16);
-									bytes[p++] = (unsigned char)(value >> 8);
-									bytes[p++] = (unsigned char)(value);
-									QOI_STATS(count_diff_24);
-								}
-							}
-							else {
-								goto encodecolor;
-							}
-						}
-					}
-					else if (mode == 1) {
-						int vr = px.rgba.r - px_prev.rgba.r;
+void qoi_unpack_deltas_scalar(qoi_rgba_t *tile, const unsigned char *packed, int count, qoi_rgba_t px) {
+	px.rgba.g = px.rgba.b = 128;
+	for (int i = 0; i < count; i++) {
+		px.rgba.r += ((packed[i >> 1] >> (4 * (i & 1))) & 0x0f) - 8;
+		tile[i] = px;
+	}
+}
 
-						if (QOI_RANGE(vr, 64)) {
-							if (QOI_RANGE(vr, 8)) {
-								if (diffRun == 16) {
-									bytes[p++] = QOI_DIFF_16 | (diffRun - 1);
+void qoi_fill_scalar(qoi_rgba_t *tile, int count, qoi_rgba_t px) {
+	for (int i = 0; i < count; i++) {
+		tile[i] = px;
+	}
+}
 
-									for (int i = 0; i < diffRun; i += 2)
-									{
-										bytes[p] = deltas[i];
-										bytes[p++] |= deltas[i + 1] << 4;
-									}
+void qoi_load_raw_scalar(qoi_rgba_t *tile, const unsigned char *raw, int count, int size, qoi_rgba_t px) {
+	px.rgba.g = px.rgba.b = 128;
+	for (int i = 0; i < count; i++, raw += size) {
+		px.rgba.r = raw[0];
+		if (size == 3) {
+			px.rgba.g = raw[1];
+			px.rgba.b = raw[2];
+		}
+		tile[i] = px;
+	}
+}
 
-									diffRun = 0;
-								}
+const qoi_kernels_t qoi_kernels_scalar = {
+	qoi_ycocg_chunk_scalar, qoi_match_run_scalar, qoi_hash_tile_scalar, qoi_classify_tile_scalar,
+	qoi_store_rgb_scalar, qoi_unpack_deltas_scalar, qoi_fill_scalar, qoi_load_raw_scalar
+};
 
-								deltas[diffRun++] = vr + 8;
-							}
-							else {
-								if (diffRun > 0) {
-									bytes[p++] = QOI_DIFF_16 | (diffRun - 1);
+#ifdef QOI_X86
 
-									for (int i = 0; i < diffRun; i += 2)
-									{
-										bytes[p] = deltas[i];
-										bytes[p++] |= deltas[i + 1] << 4;
-									}
+#if defined(__GNUC__)
+	#define QOI_TARGET_SSE2 __attribute__((target("sse2")))
+	#define QOI_TARGET_AVX2 __attribute__((target("avx2")))
+	#define QOI_TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#else
+	#define QOI_TARGET_SSE2
+	#define QOI_TARGET_AVX2
+	#define QOI_TARGET_AVX512
+#endif
 
-									diffRun = 0;
-								}
+// Signed division by 2 of each 32-bit lane, rounding towards zero. W is the
+// intrinsics prefix: _mm, _mm256 or _mm512.
+#define QOI_HALF(W, V) \
+	W##_srai_epi32(W##_add_epi32((V), W##_srli_epi32((V), 31)), 1)
+
+// RGB565 of RGBA pixels, in the low 16 bits of every 32 bit lane
+#define QOI_RGB565(W, SI, V) W##_or_##SI( \
+	W##_or_##SI( \
+		W##_slli_epi32(W##_and_##SI((V), W##_set1_epi32(0xf8)), 8), \
+		W##_and_##SI(W##_srli_epi32((V), 5), W##_set1_epi32(0x07e0)) \
+	), \
+	W##_and_##SI(W##_srli_epi32((V), 19), W##_set1_epi32(0x1f)) \
+)
+
+// Opaque tile pixels of gray input, which has no chroma to transform. Every
+// 32 bit lane of V holds one input pixel in its low byte, the rest zero.
+#define QOI_GRAY(W, SI, V) W##_or_##SI((V), W##_set1_epi32((int)0xff808000))
+
+int qoi_ctz(unsigned int v) {
+#ifdef _MSC_VER
+	unsigned long bit;
+	_BitScanForward(&bit, v);
+	return (int)bit;
+#else
+	return __builtin_ctz(v);
+#endif
+}
 
-								bytes[p++] = QOI_INDEX | (vr + 64);
-								QOI_STATS(count_index);
-							}
-						}
-						else {
-							if (diffRun > 0) {
-								bytes[p++] = QOI_DIFF_16 | (diffRun - 1);
+// SSE2, 4 pixels at a time
+
+QOI_TARGET_SSE2 __m128i qoi_ycocg_sse2(__m128i v, __m128i alpha) {
+	__m128i mask = _mm_set1_epi32(0xff);
+	__m128i r = _mm_and_si128(v, mask);
+	__m128i g = _mm_and_si128(_mm_srli_epi32(v, 8), mask);
+	__m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), mask);
+
+	__m128i co = QOI_HALF(_mm, _mm_sub_epi32(r, b));
+	__m128i tmp = _mm_add_epi32(b, QOI_HALF(_mm, co));
+	__m128i cg = QOI_HALF(_mm, _mm_sub_epi32(g, tmp));
+	__m128i y = _mm_and_si128(_mm_add_epi32(tmp, cg), mask);
+
+	co = _mm_and_si128(_mm_add_epi32(co, _mm_set1_epi32(128)), mask);
+	cg = _mm_and_si128(_mm_add_epi32(cg, _mm_set1_epi32(128)), mask);
+	return _mm_or_si128(
+		_mm_or_si128(y, _mm_slli_epi32(co, 8)),
+		_mm_or_si128(_mm_slli_epi32(cg, 16), alpha)
+	);
+}
 
-								for (int i = 0; i < diffRun; i += 2)
-								{
-									bytes[p] = deltas[i];
-									bytes[p++] |= deltas[i + 1] << 4;
-								}
+QOI_TARGET_SSE2 __m128i qoi_rgb_sse2(__m128i v) {
+	__m128i mask = _mm_set1_epi32(0xff);
+	__m128i bias = _mm_set1_epi32(128);
+	__m128i y = _mm_and_si128(v, mask);
+	__m128i co = _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(v, 8), mask), bias);
+	__m128i cg = _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(v, 16), mask), bias);
+
+	__m128i tmp = _mm_sub_epi32(y, cg);
+	__m128i g = _mm_add_epi32(_mm_add_epi32(cg, cg), tmp);
+	__m128i b = _mm_sub_epi32(tmp, QOI_HALF(_mm, co));
+	__m128i r = _mm_add_epi32(b, _mm_add_epi32(co, co));
+
+	return _mm_or_si128(
+		_mm_or_si128(_mm_and_si128(r, mask), _mm_slli_epi32(_mm_and_si128(g, mask), 8)),
+		_mm_or_si128(_mm_slli_epi32(_mm_and_si128(b, mask), 16), _mm_andnot_si128(_mm_set1_epi32(0xffffff), v))
+	);
+}
 
-								diffRun = 0;
-							}
+// SSE2 has no byte shuffle, so the layouts are rearranged with shifts on the
+// 32 bit lanes holding one input pixel each.
+QOI_TARGET_SSE2 __m128i qoi_swizzle_sse2(__m128i v, int layout) {
+	__m128i mask = _mm_set1_epi32(0xff);
+	switch (layout) {
+		case QOI_LAYOUT_BGRA:
+			return _mm_or_si128(
+				_mm_and_si128(v, _mm_set1_epi32(0xff00ff00)),
+				_mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), mask), _mm_slli_epi32(_mm_and_si128(v, mask), 16))
+			);
+		case QOI_LAYOUT_ARGB:
+			return _mm_or_si128(_mm_srli_epi32(v, 8), _mm_slli_epi32(v, 24));
+		case QOI_LAYOUT_ALPHA:
+			v = _mm_srli_epi32(v, 24);
+			return _mm_or_si128(v, _mm_or_si128(_mm_slli_epi32(v, 8), _mm_slli_epi32(v, 16)));
+		default:
+			return v;
+	}
+}
 
-							goto encodecolor;
-						}
-					}
-					else {
-						encodecolor: {
-							if (px.rgba.g == 128 && px.rgba.b == 128) {
-								bytes[p++] = QOI_COLOR_BW;
-								bytes[p++] = px.rgba.r;
-							}
-							else {
-								bytes[p++] = QOI_COLOR;
-								bytes[p++] = px.rgba.r;
-								bytes[p++] = px.rgba.g;
-								bytes[p++] = px.rgba.b;
-							}
-							QOI_STATS(count_color);
-						}
-					}
+QOI_TARGET_SSE2 void qoi_ycocg_chunk_sse2(const unsigned char *src, const unsigned char *end, int stride, const qoi_layout_t *layout, int w, int h, qoi_rgba_t *tile) {
+	int channels = layout->size;
+	__m128i alpha = _mm_set1_epi32(layout->a >= 0 ? 0xff000000 : 0);
+	__m128i opaque = _mm_set1_epi32(layout->a >= 0 ? 0 : 0xff000000);
+	int load_len = channels == 3 ? 13 : channels * 4;
+	__m128i zero = _mm_setzero_si128();
+
+	for (int y = 0; y < h; y++, src += stride, tile += w) {
+		int x = 0;
+		for (; x + 4 <= w && src + x * channels + load_len <= end; x += 4) {
+			const unsigned char *s = src + x * channels;
+			__m128i v;
+			if (channels == 1) {
+				int px;
+				memcpy(&px, s, 4);
+				v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(px), zero);
+				v = QOI_GRAY(_mm, si128, _mm_unpacklo_epi16(v, zero));
+			}
+			else {
+				if (channels == 4) {
+					v = _mm_loadu_si128((const __m128i *)s);
+				}
+				else {
+					int px[4];
+					memcpy(&px[0], s, 4);
+					memcpy(&px[1], s + 3, 4);
+					memcpy(&px[2], s + 6, 4);
+					memcpy(&px[3], s + 9, 4);
+					v = _mm_loadu_si128((const __m128i *)px);
 				}
+				v = qoi_swizzle_sse2(v, layout->layout);
+				v = qoi_ycocg_sse2(v, _mm_or_si128(_mm_and_si128(v, alpha), opaque));
+			}
+
+			if (y & 1) {
+				_mm_storeu_si128((__m128i *)(tile + w - x - 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
 			}
-		
-			if (mode == 0 && bw_pixel_count == x_pixels * y_pixels) {
-				mode = 1;
-				bytes[p++] = QOI_MODE_BW;
+			else {
+				_mm_storeu_si128((__m128i *)(tile + x), v);
 			}
 		}
-	}
 
-	for (int i = 0; i < QOI_PADDING; i++) {
-		bytes[p++] = 0;
+		for (; x < w; x++) {
+			tile[(y & 1) ? w - x - 1 : x] = qoi_ycocg(src + x * channels, layout);
+		}
 	}
-
-	*out_len = p;
-	return bytes;
 }
 
-void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
-	if (
-		data == NULL || desc == NULL ||
-		(channels != 0 && channels != 3 && channels != 4) ||
-		size < QOI_HEADER_SIZE + QOI_PADDING
-	) {
-		return NULL;
+QOI_TARGET_SSE2 int qoi_match_run_sse2(const qoi_rgba_t *tile, int count, qoi_rgba_t px) {
+	__m128i v = _mm_set1_epi32((int)px.v);
+	int n = 0;
+	for (; n + 4 <= count; n += 4) {
+		__m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(tile + n)), v);
+		unsigned int mask = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(eq));
+		if (mask != 0xf) {
+			return n + qoi_ctz(~mask);
+		}
 	}
+	return n + qoi_match_run_scalar(tile + n, count - n, px);
+}
 
-	const unsigned char *bytes = (const unsigned char *)data;
-	int p = 0;
-
-	unsigned int header_magic = qoi_read_32(bytes, &p);
-	desc->width = qoi_read_32(bytes, &p);
-	desc->height = qoi_read_32(bytes, &p);
-	desc->channels = bytes[p++];
-	desc->colorspace = bytes[p++];
-
-	if (
-		desc->width == 0 || desc->height == 0 || 
-		desc->channels < 3 || desc->channels > 4 ||
-		header_magic != QOI_MAGIC
-	) {
-		return NULL;
+// Every pixel is xor-ed with the first one and with gray, and the results
+// are or-ed up; the last vector overlaps the one before.
+QOI_TARGET_SSE2 int qoi_classify_tile_sse2(const qoi_rgba_t *tile, int count) {
+	if (count < 4) {
+		return qoi_classify_tile_scalar(tile, count);
 	}
 
-	if (channels == 0) {
-		channels = desc->channels;
+	__m128i first = _mm_set1_epi32((int)tile[0].v);
+	__m128i gray = _mm_set1_epi32(0x00808000);
+	__m128i diff = _mm_setzero_si128();
+	__m128i color = _mm_setzero_si128();
+	for (int i = 0; i < count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(tile + (i + 4 <= count ? i : count - 4)));
+		diff = _mm_or_si128(diff, _mm_xor_si128(v, first));
+		color = _mm_or_si128(color, _mm_xor_si128(v, gray));
 	}
 
-	int px_len = desc->width * desc->height * channels;
-	unsigned char *pixels = QOI_MALLOC(px_len);
-	if (!pixels) {
-		return NULL;
+	__m128i zero = _mm_setzero_si128();
+	color = _mm_and_si128(color, _mm_set1_epi32(0x00ffff00));
+	return
+		(_mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) == 0xffff ? QOI_CHUNK_SOLID : 0) |
+		(_mm_movemask_epi8(_mm_cmpeq_epi8(color, zero)) == 0xffff ? QOI_CHUNK_GRAY : 0);
+}
+
+QOI_TARGET_SSE2 void qoi_hash_tile_sse2(const qoi_rgba_t *tile, int count, unsigned char *hashes) {
+	__m128i factors = _mm_setr_epi16(-35, -39, 37, 1, -35, -39, 37, 1);
+	__m128i mask = _mm_set1_epi32(QOI_COLOR_CACHE_SIZE - 1);
+	__m128i zero = _mm_setzero_si128();
+	int i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		__m128i h[2];
+		for (int j = 0; j < 2; j++) {
+			// Two dot product halves per pixel, summed into the even lanes
+			__m128i v = _mm_loadu_si128((const __m128i *)(tile + i + j * 4));
+			__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), factors);
+			__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), factors);
+			lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+			hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+			h[j] = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0)));
+			h[j] = _mm_and_si128(h[j], mask);
+		}
+		__m128i h16 = _mm_packs_epi32(h[0], h[1]);
+		_mm_storel_epi64((__m128i *)(hashes + i), _mm_packus_epi16(h16, h16));
 	}
 
-	qoi_rgba_t px = {.rgba = {.r = 0, .g = 0, .b = 0, .a = 255}};
-	qoi_rgba_t index[QOI_COLOR_CACHE_SIZE] = { 0 };
-	qoi_rgba_t pxRGB = { 0 };
+	qoi_hash_tile_scalar(tile + i, count - i, hashes + i);
+}
 
-	int run = 0;
-	int mode = 0;
-	int chunks_len = size - QOI_PADDING;
-	
-	int chunks_x_count = desc->width / QOI_CHUNK_W;
-	int chunks_y_count = desc->height / QOI_CHUNK_H;
+// Packs the low 16 bits of every 32 bit lane into the low half
+QOI_TARGET_SSE2 __m128i qoi_pack_16_sse2(__m128i v) {
+	v = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+	return _mm_packs_epi32(v, v);
+}
 
-	for (int chunk_x = 0; chunk_x < chunks_x_count; chunk_x++) {
-		int x_pixels = QOI_CHUNK_W;
-		if (chunk_x == chunks_x_count - 1) {
-			x_pixels = desc->width - (chunks_x_count - 1) * QOI_CHUNK_W;
+QOI_TARGET_SSE2 void qoi_store_rgb_sse2(unsigned char *dst, const qoi_rgba_t *row, int inc, int count, int format) {
+	int size = QOI_FORMAT_SIZE(format);
+	int i = 0;
+	for (; i + 4 <= count; i += 4, row += 4 * inc, dst += 4 * size) {
+		__m128i v;
+		if (inc < 0) {
+			v = _mm_loadu_si128((const __m128i *)(row - 3));
+			v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+		}
+		else {
+			v = _mm_loadu_si128((const __m128i *)row);
 		}
 
-#ifdef QOI_SEPARATE_COLUMNS
-		memset(index, 0, sizeof(qoi_rgba_t) * QOI_COLOR_CACHE_SIZE);
-		run = 0;
-		px.rgba.r = 0;
-		px.rgba.g = 0;
-		px.rgba.b = 0;
-		px.rgba.a = 255;
-		pxRGB = px;
-		pxRGB.rgba.a = 0;
-		mode = 0;
-#endif
+		if (format == QOI_FORMAT_GRAY) {
+			v = qoi_pack_16_sse2(_mm_and_si128(v, _mm_set1_epi32(0xff)));
+			int gray = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+			memcpy(dst, &gray, 4);
+			continue;
+		}
+		if (format == QOI_FORMAT_GRAYA) {
+			v = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi32(0xff)), _mm_and_si128(_mm_srli_epi32(v, 16), _mm_set1_epi32(0xff00)));
+			_mm_storel_epi64((__m128i *)dst, qoi_pack_16_sse2(v));
+			continue;
+		}
 
-		for (int chunk_y = 0; chunk_y < chunks_y_count; chunk_y++) {
-			int y_pixels = QOI_CHUNK_H;
-			if (chunk_y == chunks_y_count - 1) {
-				y_pixels = desc->height - (chunks_y_count - 1) * QOI_CHUNK_H;
+		v = qoi_rgb_sse2(v);
+		switch (format) {
+			case QOI_FORMAT_BGRA:
+				v = qoi_swizzle_sse2(v, QOI_LAYOUT_BGRA);
+				// fallthrough
+			case QOI_FORMAT_RGBA:
+				_mm_storeu_si128((__m128i *)dst, v);
+				break;
+			case QOI_FORMAT_RGB565:
+				_mm_storel_epi64((__m128i *)dst, qoi_pack_16_sse2(QOI_RGB565(_mm, si128, v)));
+				break;
+			default: {
+				if (format == QOI_FORMAT_BGR) {
+					v = qoi_swizzle_sse2(v, QOI_LAYOUT_BGRA);
+				}
+				unsigned char px[16];
+				_mm_storeu_si128((__m128i *)px, v);
+				for (int j = 0; j < 4; j++) {
+					memcpy(dst + j * 3, px + j * 4, 3);
+				}
+				break;
 			}
+		}
+	}
 
-			int px_chunk_pos = ((chunk_y * QOI_CHUNK_H) * desc->width) + chunk_x * QOI_CHUNK_W;
-			unsigned char* px_ptr = pixels + px_chunk_pos * channels;
-
-			for (int y = 0, inc = channels; y < y_pixels; y++, px_chunk_pos += desc->width, inc *= -1) {
-				for (int x = 0; x < x_pixels; x++, px_ptr += inc) {
-					if (run > 0) {
-						run--;
-					}
-					else if (p < chunks_len) {
-						int b1 = bytes[p++];
+	qoi_store_rgb_scalar(dst, row, inc, count - i, format);
+}
 
-						if ((b1 & QOI_MASK_1) == QOI_INDEX) {
-							px = index[b1];
-						}
-						else if ((b1 & QOI_MASK_3) == QOI_RUN_8) {
-							run = b1 & 0x1f;
-							while (p < chunks_len && ((b1 = bytes[p]) & QOI_MASK_3) == QOI_RUN_8)
-							{
-								p++;
-								run <<= 5;
-								run += b1 & 0x1f;
-							}
-							// no need to increment here, one implied copy
-						}
-						else if ((b1 & QOI_MASK_2) == QOI_DIFF_8) {
-							px.rgba.r += ((b1 >> 4) & 0x03) - 2;
-							px.rgba.g += ((b1 >> 2) & 0x03) - 2;
-							px.rgba.b += ( b1       & 0x03) - 2;
-							QOI_SAVE_COLOR(px);
-						}
-						else if ((b1 & QOI_MASK_4) == QOI_DIFF_16) {
-							b1 = (b1 << 8) + bytes[p++];
+// The lumas of a BW mode delta group, one per byte: the nibbles are spread
+// to bytes in order and summed up in four shifted adds
+QOI_TARGET_SSE2 __m128i qoi_deltas_sse2(const unsigned char *packed, int y) {
+	__m128i nibble = _mm_set1_epi8(0x0f);
+	__m128i v = _mm_loadl_epi64((const __m128i *)packed);
+	v = _mm_unpacklo_epi8(_mm_and_si128(v, nibble), _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+	v = _mm_sub_epi8(v, _mm_set1_epi8(8));
+	v = _mm_add_epi8(v, _mm_slli_si128(v, 1));
+	v = _mm_add_epi8(v, _mm_slli_si128(v, 2));
+	v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+	v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+	return _mm_add_epi8(v, _mm_set1_epi8((char)y));
+}
 
-							if (mode == 0) {
-								px.rgba.r += ((b1 >> 8) & 0x0f) - 8;
-								px.rgba.g += ((b1 >> 4) & 0x0f) - 8;
-								px.rgba.b += (b1 & 0x0f) - 8;
-							}
-							else {
-								px.rgba.r += ((b1 >> 8) & 0x0f) - 8;
-								px.rgba.g += ((b1 >> 4) & 0x0f) - 8;
-								px.rgba.b += (b1 & 0x0f) - 8;
-								px.rgba.a += ((b1 >> 12) & 0x03) - 2;
-							}
+QOI_TARGET_SSE2 void qoi_unpack_deltas_sse2(qoi_rgba_t *tile, const unsigned char *packed, int count, qoi_rgba_t px) {
+	(void)count;
+	__m128i y = qoi_deltas_sse2(packed, px.rgba.r);
+	__m128i gray = _mm_set1_epi32((int)(0x00808000u | ((unsigned int)px.rgba.a << 24)));
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_unpacklo_epi8(y, zero);
+	__m128i hi = _mm_unpackhi_epi8(y, zero);
+	_mm_storeu_si128((__m128i *)tile, _mm_or_si128(_mm_unpacklo_epi16(lo, zero), gray));
+	_mm_storeu_si128((__m128i *)tile + 1, _mm_or_si128(_mm_unpackhi_epi16(lo, zero), gray));
+	_mm_storeu_si128((__m128i *)tile + 2, _mm_or_si128(_mm_unpacklo_epi16(hi, zero), gray));
+	_mm_storeu_si128((__m128i *)tile + 3, _mm_or_si128(_mm_unpackhi_epi16(hi, zero), gray));
+}
 
-							QOI_SAVE_COLOR(px);
+QOI_TARGET_SSE2 void qoi_fill_sse2(qoi_rgba_t *tile, int count, qoi_rgba_t px) {
+	__m128i v = _mm_set1_epi32((int)px.v);
+	for (int i = 0; i < count; i += 4) {
+		_mm_storeu_si128((__m128i *)(tile + i), v);
+	}
+}
+
+QOI_TARGET_SSE2 void qoi_load_raw_sse2(qoi_rgba_t *tile, const unsigned char *raw, int count, int size, qoi_rgba_t px) {
+	__m128i alpha = _mm_set1_epi32((int)((unsigned int)px.rgba.a << 24));
+	int i = 0;
+	if (size == 3) {
+		__m128i mask = _mm_set1_epi32(0x00ffffff);
+		for (; i + 4 <= count; i += 4, raw += 12) {
+			int v[4];
+			memcpy(&v[0], raw, 4);
+			memcpy(&v[1], raw + 3, 4);
+			memcpy(&v[2], raw + 6, 4);
+			memcpy(&v[3], raw + 9, 4);
+			__m128i p = _mm_and_si128(_mm_loadu_si128((const __m128i *)v), mask);
+			_mm_storeu_si128((__m128i *)(tile + i), _mm_or_si128(p, alpha));
+		}
+	}
+	else {
+		__m128i gray = _mm_or_si128(_mm_set1_epi32(0x00808000), alpha);
+		__m128i zero = _mm_setzero_si128();
+		for (; i + 16 <= count; i += 16, raw += 16) {
+			__m128i y = _mm_loadu_si128((const __m128i *)raw);
+			__m128i lo = _mm_unpacklo_epi8(y, zero);
+			__m128i hi = _mm_unpackhi_epi8(y, zero);
+			_mm_storeu_si128((__m128i *)(tile + i), _mm_or_si128(_mm_unpacklo_epi16(lo, zero), gray));
+			_mm_storeu_si128((__m128i *)(tile + i) + 1, _mm_or_si128(_mm_unpackhi_epi16(lo, zero), gray));
+			_mm_storeu_si128((__m128i *)(tile + i) + 2, _mm_or_si128(_mm_unpacklo_epi16(hi, zero), gray));
+			_mm_storeu_si128((__m128i *)(tile + i) + 3, _mm_or_si128(_mm_unpackhi_epi16(hi, zero), gray));
+		}
+	}
+	qoi_load_raw_scalar(tile + i, raw, count - i, size, px);
+}
+
+// AVX2, 8 pixels at a time
+
+QOI_TARGET_AVX2 __m256i qoi_ycocg_avx2(__m256i v, __m256i alpha) {
+	__m256i mask = _mm256_set1_epi32(0xff);
+	__m256i r = _mm256_and_si256(v, mask);
+	__m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 8), mask);
+	__m256i b = _mm256_and_si256(_mm256_srli_epi32(v, 16), mask);
+
+	__m256i co = QOI_HALF(_mm256, _mm256_sub_epi32(r, b));
+	__m256i tmp = _mm256_add_epi32(b, QOI_HALF(_mm256, co));
+	__m256i cg = QOI_HALF(_mm256, _mm256_sub_epi32(g, tmp));
+	__m256i y = _mm256_and_si256(_mm256_add_epi32(tmp, cg), mask);
+
+	co = _mm256_and_si256(_mm256_add_epi32(co, _mm256_set1_epi32(128)), mask);
+	cg = _mm256_and_si256(_mm256_add_epi32(cg, _mm256_set1_epi32(128)), mask);
+	return _mm256_or_si256(
+		_mm256_or_si256(y, _mm256_slli_epi32(co, 8)),
+		_mm256_or_si256(_mm256_slli_epi32(cg, 16), alpha)
+	);
+}
+
+QOI_TARGET_AVX2 __m256i qoi_rgb_avx2(__m256i v) {
+	__m256i mask = _mm256_set1_epi32(0xff);
+	__m256i bias = _mm256_set1_epi32(128);
+	__m256i y = _mm256_and_si256(v, mask);
+	__m256i co = _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(v, 8), mask), bias);
+	__m256i cg = _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(v, 16), mask), bias);
+
+	__m256i tmp = _mm256_sub_epi32(y, cg);
+	__m256i g = _mm256_add_epi32(_mm256_add_epi32(cg, cg), tmp);
+	__m256i b = _mm256_sub_epi32(tmp, QOI_HALF(_mm256, co));
+	__m256i r = _mm256_add_epi32(b, _mm256_add_epi32(co, co));
+
+	return _mm256_or_si256(
+		_mm256_or_si256(_mm256_and_si256(r, mask), _mm256_slli_epi32(_mm256_and_si256(g, mask), 8)),
+		_mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(b, mask), 16), _mm256_andnot_si256(_mm256_set1_epi32(0xffffff), v))
+	);
+}
+
+QOI_TARGET_AVX2 void qoi_ycocg_chunk_avx2(const unsigned char *src, const unsigned char *end, int stride, const qoi_layout_t *layout, int w, int h, qoi_rgba_t *tile) {
+	int channels = layout->size;
+	int identity = channels == 4 && layout->layout == QOI_LAYOUT_RGBA;
+	signed char shuffle[16];
+	qoi_layout_shuffle(layout, shuffle);
+
+	__m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i opaque = _mm256_set1_epi32(layout->a >= 0 ? 0 : 0xff000000);
+	__m128i rgb = _mm_loadu_si128((const __m128i *)shuffle);
+	int load_len = channels == 3 ? 28 : channels * 8;
+
+	for (int y = 0; y < h; y++, src += stride, tile += w) {
+		int x = 0;
+		for (; x + 8 <= w && src + x * channels + load_len <= end; x += 8) {
+			const unsigned char *s = src + x * channels;
+			__m256i v;
+			if (channels == 1) {
+				v = QOI_GRAY(_mm256, si256, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)s)));
+			}
+			else {
+				if (identity) {
+					v = _mm256_loadu_si256((const __m256i *)s);
+				}
+				else if (channels == 4) {
+					v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)s), _mm256_broadcastsi128_si256(rgb));
+				}
+				else {
+					__m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)s), rgb);
+					__m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(s + 12)), rgb);
+					v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+				}
+				// The shuffle leaves a missing alpha zero
+				v = qoi_ycocg_avx2(v, _mm256_or_si256(_mm256_and_si256(v, _mm256_set1_epi32(0xff000000)), opaque));
+			}
+
+			if (y & 1) {
+				_mm256_storeu_si256((__m256i *)(tile + w - x - 8), _mm256_permutevar8x32_epi32(v, reverse));
+			}
+			else {
+				_mm256_storeu_si256((__m256i *)(tile + x), v);
+			}
+		}
+
+		for (; x < w; x++) {
+			tile[(y & 1) ? w - x - 1 : x] = qoi_ycocg(src + x * channels, layout);
+		}
+	}
+}
+
+QOI_TARGET_AVX2 int qoi_match_run_avx2(const qoi_rgba_t *tile, int count, qoi_rgba_t px) {
+	__m256i v = _mm256_set1_epi32((int)px.v);
+	int n = 0;
+	for (; n + 8 <= count; n += 8) {
+		__m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(tile + n)), v);
+		unsigned int mask = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(eq));
+		if (mask != 0xff) {
+			return n + qoi_ctz(~mask);
+		}
+	}
+	return n + qoi_match_run_scalar(tile + n, count - n, px);
+}
+
+QOI_TARGET_AVX2 int qoi_classify_tile_avx2(const qoi_rgba_t *tile, int count) {
+	if (count < 8) {
+		return qoi_classify_tile_sse2(tile, count);
+	}
+
+	__m256i first = _mm256_set1_epi32((int)tile[0].v);
+	__m256i gray = _mm256_set1_epi32(0x00808000);
+	__m256i diff = _mm256_setzero_si256();
+	__m256i color = _mm256_setzero_si256();
+	for (int i = 0; i < count; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(tile + (i + 8 <= count ? i : count - 8)));
+		diff = _mm256_or_si256(diff, _mm256_xor_si256(v, first));
+		color = _mm256_or_si256(color, _mm256_xor_si256(v, gray));
+	}
+
+	color = _mm256_and_si256(color, _mm256_set1_epi32(0x00ffff00));
+	return
+		(_mm256_testz_si256(diff, diff) ? QOI_CHUNK_SOLID : 0) |
+		(_mm256_testz_si256(color, color) ? QOI_CHUNK_GRAY : 0);
+}
+
+QOI_TARGET_AVX2 void qoi_hash_tile_avx2(const qoi_rgba_t *tile, int count, unsigned char *hashes) {
+	__m256i factors = _mm256_set1_epi32(0x0125d9dd); // -35, -39, 37, 1
+	__m256i ones = _mm256_set1_epi16(1);
+	__m256i mask = _mm256_set1_epi32(QOI_COLOR_CACHE_SIZE - 1);
+	__m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(tile + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(tile + i + 8));
+		a = _mm256_and_si256(_mm256_madd_epi16(_mm256_maddubs_epi16(a, factors), ones), mask);
+		b = _mm256_and_si256(_mm256_madd_epi16(_mm256_maddubs_epi16(b, factors), ones), mask);
+
+		// 16 x 32 bit -> 16 x 8 bit
+		__m256i h = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(_mm256_packus_epi32(a, b), _mm256_setzero_si256()), order);
+		_mm_storeu_si128((__m128i *)(hashes + i), _mm256_castsi256_si128(h));
+	}
+
+	qoi_hash_tile_scalar(tile + i, count - i, hashes + i);
+}
+
+QOI_TARGET_AVX2 void qoi_store_rgb_avx2(unsigned char *dst, const qoi_rgba_t *row, int inc, int count, int format) {
+	__m256i backwards = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	int size = QOI_FORMAT_SIZE(format);
+	int i = 0;
+
+	// Every format but RGBA is a byte shuffle within each 128 bit lane; gray
+	// (with alpha) and RGB565 then join the two halves with a permute.
+	__m128i rgb;
+	__m256i join = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+	switch (format) {
+		case QOI_FORMAT_GRAY:
+			rgb = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+			join = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+			break;
+		case QOI_FORMAT_GRAYA:
+			rgb = _mm_setr_epi8(0, 3, 4, 7, 8, 11, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+			break;
+		case QOI_FORMAT_RGB565:
+			rgb = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1);
+			break;
+		case QOI_FORMAT_BGR:
+			rgb = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+			break;
+		case QOI_FORMAT_BGRA:
+			rgb = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+			break;
+		default:
+			rgb = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+			break;
+	}
+	__m256i shuffle = _mm256_broadcastsi128_si256(rgb);
+
+	for (; i + 8 <= count; i += 8, row += 8 * inc, dst += 8 * size) {
+		__m256i v;
+		if (inc < 0) {
+			v = _mm256_loadu_si256((const __m256i *)(row - 7));
+			v = _mm256_permutevar8x32_epi32(v, backwards);
+		}
+		else {
+			v = _mm256_loadu_si256((const __m256i *)row);
+		}
+
+		if (format == QOI_FORMAT_GRAY) {
+			v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuffle), join);
+			_mm_storel_epi64((__m128i *)dst, _mm256_castsi256_si128(v));
+			continue;
+		}
+		if (format == QOI_FORMAT_GRAYA) {
+			v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuffle), join);
+			_mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(v));
+			continue;
+		}
+
+		v = qoi_rgb_avx2(v);
+		if (format == QOI_FORMAT_RGBA) {
+			_mm256_storeu_si256((__m256i *)dst, v);
+		}
+		else if (format == QOI_FORMAT_BGRA) {
+			_mm256_storeu_si256((__m256i *)dst, _mm256_shuffle_epi8(v, shuffle));
+		}
+		else if (format == QOI_FORMAT_RGB565) {
+			v = _mm256_shuffle_epi8(QOI_RGB565(_mm256, si256, v), shuffle);
+			_mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(v, join)));
+		}
+		else {
+			// 12-byte stores, so neighbouring pixels are never touched
+			__m128i lo = _mm_shuffle_epi8(_mm256_castsi256_si128(v), rgb);
+			__m128i hi = _mm_shuffle_epi8(_mm256_extracti128_si256(v, 1), rgb);
+			int lo_last = _mm_extract_epi32(lo, 2);
+			int hi_last = _mm_extract_epi32(hi, 2);
+			_mm_storel_epi64((__m128i *)dst, lo);
+			memcpy(dst + 8, &lo_last, 4);
+			_mm_storel_epi64((__m128i *)(dst + 12), hi);
+			memcpy(dst + 20, &hi_last, 4);
+		}
+	}
+
+	qoi_store_rgb_scalar(dst, row, inc, count - i, format);
+}
+
+QOI_TARGET_AVX2 void qoi_unpack_deltas_avx2(qoi_rgba_t *tile, const unsigned char *packed, int count, qoi_rgba_t px) {
+	(void)count;
+	__m128i y = qoi_deltas_sse2(packed, px.rgba.r);
+	__m256i gray = _mm256_set1_epi32((int)(0x00808000u | ((unsigned int)px.rgba.a << 24)));
+	_mm256_storeu_si256((__m256i *)tile, _mm256_or_si256(_mm256_cvtepu8_epi32(y), gray));
+	_mm256_storeu_si256((__m256i *)tile + 1, _mm256_or_si256(_mm256_cvtepu8_epi32(_mm_srli_si128(y, 8)), gray));
+}
+
+QOI_TARGET_AVX2 void qoi_fill_avx2(qoi_rgba_t *tile, int count, qoi_rgba_t px) {
+	__m256i v = _mm256_set1_epi32((int)px.v);
+	for (int i = 0; i < count; i += 8) {
+		_mm256_storeu_si256((__m256i *)(tile + i), v);
+	}
+}
+
+// Every 128-bit lane spreads the 12 bytes of 4 pixels, loaded 16 at a time
+QOI_TARGET_AVX2 void qoi_load_raw_avx2(qoi_rgba_t *tile, const unsigned char *raw, int count, int size, qoi_rgba_t px) {
+	__m256i alpha = _mm256_set1_epi32((int)((unsigned int)px.rgba.a << 24));
+	int i = 0;
+	if (size == 3) {
+		__m256i spread = _mm256_setr_epi8(
+			0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+			0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1
+		);
+		for (; i + 8 <= count; i += 8, raw += 24) {
+			__m256i v = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)raw)),
+				_mm_loadu_si128((const __m128i *)(raw + 12)), 1
+			);
+			_mm256_storeu_si256((__m256i *)(tile + i), _mm256_or_si256(_mm256_shuffle_epi8(v, spread), alpha));
+		}
+	}
+	else {
+		__m256i gray = _mm256_or_si256(_mm256_set1_epi32(0x00808000), alpha);
+		for (; i + 16 <= count; i += 16, raw += 16) {
+			__m128i y = _mm_loadu_si128((const __m128i *)raw);
+			_mm256_storeu_si256((__m256i *)(tile + i), _mm256_or_si256(_mm256_cvtepu8_epi32(y), gray));
+			_mm256_storeu_si256((__m256i *)(tile + i) + 1, _mm256_or_si256(_mm256_cvtepu8_epi32(_mm_srli_si128(y, 8)), gray));
+		}
+	}
+	qoi_load_raw_scalar(tile + i, raw, count - i, size, px);
+}
+
+// AVX-512, 16 pixels at a time. Masked loads and stores handle the tails.
+
+// GCC 12 builds most AVX-512 intrinsics on an uninitialized vector in C++,
+// which warns wherever they are inlined
+#if defined(__GNUC__) && !defined(__clang__)
+	#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Wuninitialized"
+	#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+QOI_TARGET_AVX512 __m512i qoi_ycocg_avx512(__m512i v, __m512i alpha) {
+	__m512i mask = _mm512_set1_epi32(0xff);
+	__m512i r = _mm512_and_si512(v, mask);
+	__m512i g = _mm512_and_si512(_mm512_srli_epi32(v, 8), mask);
+	__m512i b = _mm512_and_si512(_mm512_srli_epi32(v, 16), mask);
+
+	__m512i co = QOI_HALF(_mm512, _mm512_sub_epi32(r, b));
+	__m512i tmp = _mm512_add_epi32(b, QOI_HALF(_mm512, co));
+	__m512i cg = QOI_HALF(_mm512, _mm512_sub_epi32(g, tmp));
+	__m512i y = _mm512_and_si512(_mm512_add_epi32(tmp, cg), mask);
+
+	co = _mm512_and_si512(_mm512_add_epi32(co, _mm512_set1_epi32(128)), mask);
+	cg = _mm512_and_si512(_mm512_add_epi32(cg, _mm512_set1_epi32(128)), mask);
+	return _mm512_or_si512(
+		_mm512_or_si512(y, _mm512_slli_epi32(co, 8)),
+		_mm512_or_si512(_mm512_slli_epi32(cg, 16), alpha)
+	);
+}
+
+QOI_TARGET_AVX512 __m512i qoi_rgb_avx512(__m512i v) {
+	__m512i mask = _mm512_set1_epi32(0xff);
+	__m512i bias = _mm512_set1_epi32(128);
+	__m512i y = _mm512_and_si512(v, mask);
+	__m512i co = _mm512_sub_epi32(_mm512_and_si512(_mm512_srli_epi32(v, 8), mask), bias);
+	__m512i cg = _mm512_sub_epi32(_mm512_and_si512(_mm512_srli_epi32(v, 16), mask), bias);
+
+	__m512i tmp = _mm512_sub_epi32(y, cg);
+	__m512i g = _mm512_add_epi32(_mm512_add_epi32(cg, cg), tmp);
+	__m512i b = _mm512_sub_epi32(tmp, QOI_HALF(_mm512, co));
+	__m512i r = _mm512_add_epi32(b, _mm512_add_epi32(co, co));
+
+	return _mm512_or_si512(
+		_mm512_or_si512(_mm512_and_si512(r, mask), _mm512_slli_epi32(_mm512_and_si512(g, mask), 8)),
+		_mm512_or_si512(_mm512_slli_epi32(_mm512_and_si512(b, mask), 16), _mm512_andnot_si512(_mm512_set1_epi32(0xffffff), v))
+	);
+}
+
+QOI_TARGET_AVX512 void qoi_ycocg_chunk_avx512(const unsigned char *src, const unsigned char *end, int stride, const qoi_layout_t *layout, int w, int h, qoi_rgba_t *tile) {
+	int channels = layout->size;
+	int identity = channels == 4 && layout->layout == QOI_LAYOUT_RGBA;
+	signed char shuffle[16];
+	qoi_layout_shuffle(layout, shuffle);
+
+	__m512i iota = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m512i spread = _mm512_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6, 6, 7, 8, 9, 9, 10, 11, 12);
+	__m512i rgb = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)shuffle));
+	__m512i opaque = _mm512_set1_epi32(layout->a >= 0 ? 0 : 0xff000000);
+	(void)end;
+
+	for (int y = 0; y < h; y++, src += stride, tile += w) {
+		for (int x = 0; x < w; x += 16) {
+			int n = w - x < 16 ? w - x : 16;
+			__mmask16 m = (__mmask16)((1u << n) - 1);
+			const unsigned char *s = src + x * channels;
+			__m512i v;
+			if (channels == 1) {
+				v = _mm512_cvtepu8_epi32(_mm512_castsi512_si128(_mm512_maskz_loadu_epi8((__mmask64)m, s)));
+				v = QOI_GRAY(_mm512, si512, v);
+			}
+			else {
+				if (identity) {
+					v = _mm512_maskz_loadu_epi32(m, s);
+				}
+				else if (channels == 4) {
+					v = _mm512_shuffle_epi8(_mm512_maskz_loadu_epi32(m, s), rgb);
+				}
+				else {
+					// Spread the 12 bytes of every 4 pixels over a 128-bit lane
+					v = _mm512_maskz_loadu_epi8((__mmask64)((1ull << (n * 3)) - 1), s);
+					v = _mm512_shuffle_epi8(_mm512_permutexvar_epi32(spread, v), rgb);
+				}
+				// The shuffle leaves a missing alpha zero
+				v = qoi_ycocg_avx512(v, _mm512_or_si512(_mm512_and_si512(v, _mm512_set1_epi32(0xff000000)), opaque));
+			}
+
+			if (y & 1) {
+				__m512i backwards = _mm512_sub_epi32(_mm512_set1_epi32(n - 1), iota);
+				_mm512_mask_storeu_epi32(tile + w - x - n, m, _mm512_permutexvar_epi32(backwards, v));
+			}
+			else {
+				_mm512_mask_storeu_epi32(tile + x, m, v);
+			}
+		}
+	}
+}
+
+QOI_TARGET_AVX512 int qoi_match_run_avx512(const qoi_rgba_t *tile, int count, qoi_rgba_t px) {
+	__m512i v = _mm512_set1_epi32((int)px.v);
+	for (int n = 0; n < count; n += 16) {
+		__mmask16 m = (__mmask16)(count - n < 16 ? (1u << (count - n)) - 1 : 0xffff);
+		__mmask16 eq = _mm512_mask_cmpeq_epi32_mask(m, _mm512_maskz_loadu_epi32(m, tile + n), v);
+		if (eq != m) {
+			return n + qoi_ctz(~(unsigned int)eq & m);
+		}
+	}
+	return count;
+}
+
+QOI_TARGET_AVX512 int qoi_classify_tile_avx512(const qoi_rgba_t *tile, int count) {
+	__m512i first = _mm512_set1_epi32((int)tile[0].v);
+	__m512i gray = _mm512_set1_epi32(0x00808000);
+	__m512i diff = _mm512_setzero_si512();
+	__m512i color = _mm512_setzero_si512();
+	for (int i = 0; i < count; i += 16) {
+		// Lanes past the end load the first pixel, which is neutral for diff
+		__mmask16 m = (__mmask16)(count - i < 16 ? (1u << (count - i)) - 1 : 0xffff);
+		__m512i v = _mm512_mask_loadu_epi32(first, m, tile + i);
+		diff = _mm512_or_si512(diff, _mm512_xor_si512(v, first));
+		color = _mm512_or_si512(color, _mm512_mask_xor_epi32(_mm512_setzero_si512(), m, v, gray));
+	}
+
+	return
+		(_mm512_test_epi32_mask(diff, diff) == 0 ? QOI_CHUNK_SOLID : 0) |
+		(_mm512_test_epi32_mask(color, _mm512_set1_epi32(0x00ffff00)) == 0 ? QOI_CHUNK_GRAY : 0);
+}
+
+QOI_TARGET_AVX512 void qoi_hash_tile_avx512(const qoi_rgba_t *tile, int count, unsigned char *hashes) {
+	__m512i factors = _mm512_set1_epi32(0x0125d9dd); // -35, -39, 37, 1
+	__m512i ones = _mm512_set1_epi16(1);
+	__m512i mask = _mm512_set1_epi32(QOI_COLOR_CACHE_SIZE - 1);
+
+	for (int i = 0; i < count; i += 16) {
+		__mmask16 m = (__mmask16)(count - i < 16 ? (1u << (count - i)) - 1 : 0xffff);
+		__m512i v = _mm512_maskz_loadu_epi32(m, tile + i);
+		v = _mm512_and_si512(_mm512_madd_epi16(_mm512_maddubs_epi16(v, factors), ones), mask);
+		_mm512_mask_cvtepi32_storeu_epi8(hashes + i, m, v);
+	}
+}
+
+QOI_TARGET_AVX512 void qoi_store_rgb_avx512(unsigned char *dst, const qoi_rgba_t *row, int inc, int count, int format) {
+	__m512i iota = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m512i rgb = _mm512_broadcast_i32x4(
+		format == QOI_FORMAT_BGR || format == QOI_FORMAT_BGRA
+			? _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)
+			: _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1)
+	);
+	__m512i bgra = _mm512_broadcast_i32x4(_mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15));
+	__m512i pack = _mm512_setr_epi32(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 0, 0, 0, 0);
+	int size = QOI_FORMAT_SIZE(format);
+
+	for (int i = 0; i < count; i += 16, row += 16 * inc, dst += 16 * size) {
+		int n = count - i < 16 ? count - i : 16;
+		__mmask16 m = (__mmask16)((1u << n) - 1);
+		__m512i v;
+		if (inc < 0) {
+			v = _mm512_maskz_loadu_epi32(m, row - n + 1);
+			v = _mm512_permutexvar_epi32(_mm512_sub_epi32(_mm512_set1_epi32(n - 1), iota), v);
+		}
+		else {
+			v = _mm512_maskz_loadu_epi32(m, row);
+		}
+		if (format == QOI_FORMAT_GRAY) {
+			_mm512_mask_cvtepi32_storeu_epi8(dst, m, v);
+			continue;
+		}
+		if (format == QOI_FORMAT_GRAYA) {
+			v = _mm512_or_si512(_mm512_and_si512(v, _mm512_set1_epi32(0xff)), _mm512_and_si512(_mm512_srli_epi32(v, 16), _mm512_set1_epi32(0xff00)));
+			_mm512_mask_cvtepi32_storeu_epi16(dst, m, v);
+			continue;
+		}
+
+		v = qoi_rgb_avx512(v);
+		switch (format) {
+			case QOI_FORMAT_BGRA:
+				v = _mm512_shuffle_epi8(v, bgra);
+				// fallthrough
+			case QOI_FORMAT_RGBA:
+				_mm512_mask_storeu_epi32(dst, m, v);
+				break;
+			case QOI_FORMAT_RGB565:
+				_mm512_mask_cvtepi32_storeu_epi16(dst, m, QOI_RGB565(_mm512, si512, v));
+				break;
+			default:
+				v = _mm512_permutexvar_epi32(pack, _mm512_shuffle_epi8(v, rgb));
+				_mm512_mask_storeu_epi8(dst, (__mmask64)((1ull << (n * 3)) - 1), v);
+				break;
+		}
+	}
+}
+
+QOI_TARGET_AVX512 void qoi_unpack_deltas_avx512(qoi_rgba_t *tile, const unsigned char *packed, int count, qoi_rgba_t px) {
+	(void)count;
+	__m128i y = qoi_deltas_sse2(packed, px.rgba.r);
+	__m512i gray = _mm512_set1_epi32((int)(0x00808000u | ((unsigned int)px.rgba.a << 24)));
+	_mm512_storeu_si512(tile, _mm512_or_si512(_mm512_cvtepu8_epi32(y), gray));
+}
+
+QOI_TARGET_AVX512 void qoi_fill_avx512(qoi_rgba_t *tile, int count, qoi_rgba_t px) {
+	__m512i v = _mm512_set1_epi32((int)px.v);
+	for (int i = 0; i < count; i += 16) {
+		_mm512_storeu_si512(tile + i, v);
+	}
+}
+
+QOI_TARGET_AVX512 void qoi_load_raw_avx512(qoi_rgba_t *tile, const unsigned char *raw, int count, int size, qoi_rgba_t px) {
+	__m512i spread = _mm512_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6, 6, 7, 8, 9, 9, 10, 11, 12);
+	__m512i rgb = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1));
+	__m512i alpha = _mm512_set1_epi32((int)((unsigned int)px.rgba.a << 24));
+	__m512i gray = _mm512_or_si512(_mm512_set1_epi32(0x00808000), alpha);
+
+	for (int i = 0; i < count; i += 16, raw += 16 * size) {
+		int n = count - i < 16 ? count - i : 16;
+		__mmask16 m = (__mmask16)((1u << n) - 1);
+		__m512i v;
+		if (size == 3) {
+			v = _mm512_maskz_loadu_epi8((__mmask64)((1ull << (n * 3)) - 1), raw);
+			v = _mm512_or_si512(_mm512_shuffle_epi8(_mm512_permutexvar_epi32(spread, v), rgb), alpha);
+		}
+		else {
+			v = _mm512_cvtepu8_epi32(_mm512_castsi512_si128(_mm512_maskz_loadu_epi8((__mmask64)m, raw)));
+			v = _mm512_or_si512(v, gray);
+		}
+		_mm512_mask_storeu_epi32(tile + i, m, v);
+	}
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+	#pragma GCC diagnostic pop
+#endif
+
+const qoi_kernels_t qoi_kernels_sse2 = {
+	qoi_ycocg_chunk_sse2, qoi_match_run_sse2, qoi_hash_tile_sse2, qoi_classify_tile_sse2,
+	qoi_store_rgb_sse2, qoi_unpack_deltas_sse2, qoi_fill_sse2, qoi_load_raw_sse2
+};
+
+const qoi_kernels_t qoi_kernels_avx2 = {
+	qoi_ycocg_chunk_avx2, qoi_match_run_avx2, qoi_hash_tile_avx2, qoi_classify_tile_avx2,
+	qoi_store_rgb_avx2, qoi_unpack_deltas_avx2, qoi_fill_avx2, qoi_load_raw_avx2
+};
+
+const qoi_kernels_t qoi_kernels_avx512 = {
+	qoi_ycocg_chunk_avx512, qoi_match_run_avx512, qoi_hash_tile_avx512, qoi_classify_tile_avx512,
+	qoi_store_rgb_avx512, qoi_unpack_deltas_avx512, qoi_fill_avx512, qoi_load_raw_avx512
+};
+
+void qoi_cpuid(unsigned int leaf, unsigned int sub, unsigned int regs[4]) {
+#ifdef _MSC_VER
+	__cpuidex((int *)regs, (int)leaf, (int)sub);
+#else
+	__cpuid_count(leaf, sub, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// The register state the OS saves on context switches (XCR0)
+unsigned long long qoi_xgetbv(void) {
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned int lo, hi;
+	__asm__ __volatile__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+// Returns the best kernels this CPU supports: 0 = scalar, 1 = SSE2, 2 = AVX2,
+// 3 = AVX-512 F and BW
+int qoi_cpu_level(void) {
+	unsigned int regs[4];
+	qoi_cpuid(0, 0, regs);
+	unsigned int max_leaf = regs[0];
+
+	qoi_cpuid(1, 0, regs);
+	if (!(regs[3] & (1u << 26))) {
+		return 0;
+	}
+
+	// AVX needs OSXSAVE and the OS saving the ymm (and zmm) registers
+	int level = 1;
+	if (max_leaf >= 7 && (regs[2] & (1u << 27)) && (regs[2] & (1u << 28))) {
+		unsigned long long xcr0 = qoi_xgetbv();
+		qoi_cpuid(7, 0, regs);
+		if ((xcr0 & 0x06) == 0x06 && (regs[1] & (1u << 5))) {
+			level = 2;
+			if ((xcr0 & 0xe6) == 0xe6 && (regs[1] & (1u << 16)) && (regs[1] & (1u << 30))) {
+				level = 3;
+			}
+		}
+	}
+	return level;
+}
+
+#endif // QOI_X86
+
+const qoi_kernels_t *qoi_kernels;
+
+const qoi_kernels_t *qoi_get_kernels(void) {
+	// Every thread picks the same set, so racing on the first call is harmless
+	// as long as the pointer itself is loaded and stored atomically
+	const qoi_kernels_t *k = (const qoi_kernels_t *)QOI_ATOMIC_LOAD_PTR(&qoi_kernels);
+	if (!k) {
+		k = &qoi_kernels_scalar;
+#ifdef QOI_X86
+		switch (qoi_cpu_level()) {
+			case 3: k = &qoi_kernels_avx512; break;
+			case 2: k = &qoi_kernels_avx2; break;
+			case 1: k = &qoi_kernels_sse2; break;
+		}
+#endif
+		QOI_ATOMIC_STORE_PTR(&qoi_kernels, k);
+	}
+	return k;
+}
+
+// -----------------------------------------------------------------------------
+// Encoder
+
+// A column strip walks down the image one short row at a time, which the
+// hardware prefetchers don't pick up, so the rows of the next chunk are
+// requested while the current one is encoded.
+void qoi_prefetch_rows(const unsigned char *src, int stride, int row_len, int h) {
+	for (int y = 0; y < h; y++, src += stride) {
+		QOI_PREFETCH(src);
+		QOI_PREFETCH(src + row_len - 1);
+	}
+}
+
+typedef struct {
+	qoi_rgba_t index[QOI_COLOR_CACHE_SIZE];
+	int deltas[QOI_COLOR_CACHE_SIZE];
+	qoi_rgba_t px_prev;
+	qoi_rgba_t px;
+	int run;
+	int diffRun;
+	int mode;
+	int px_count;
+} qoi_enc_state_t;
+
+void qoi_enc_state_reset(qoi_enc_state_t *s, const qoi_desc *desc) {
+	memset(s->index, 0, sizeof(qoi_rgba_t) * QOI_COLOR_CACHE_SIZE);
+	memset(s->deltas, 0, sizeof(int) * QOI_COLOR_CACHE_SIZE);
+	s->run = 0;
+	s->diffRun = 0;
+	s->px_prev.rgba.r = 0;
+	s->px_prev.rgba.g = 0;
+	s->px_prev.rgba.b = 0;
+	s->px_prev.rgba.a = 255;
+	s->px = s->px_prev;
+	s->mode = 0;
+	s->px_count = desc->width * desc->height;
+}
+
+// The chunk grid of an image. Column strips are QOI_CHUNK_W pixels wide, the
+// last one takes the remainder (up to twice that, or the whole width of a
+// narrower image). Every strip is cut into segments of segment_rows chunk
+// rows; segments are stored strip by strip, top to bottom.
+typedef struct {
+	int chunks_x;
+	int chunks_y;
+	int segment_rows;
+	int segments_y;
+	int segments;
+} qoi_grid_t;
+
+void qoi_grid_init(qoi_grid_t *grid, const qoi_desc *desc) {
+	grid->chunks_x = desc->width < QOI_CHUNK_W ? 1 : desc->width / QOI_CHUNK_W;
+	grid->chunks_y = desc->height < QOI_CHUNK_H ? 1 : desc->height / QOI_CHUNK_H;
+	grid->segment_rows = grid->chunks_y;
+	if (desc->restart_interval > 0 && desc->restart_interval < grid->chunks_y) {
+		grid->segment_rows = desc->restart_interval;
+	}
+	grid->segments_y = (grid->chunks_y + grid->segment_rows - 1) / grid->segment_rows;
+	grid->segments = grid->chunks_x * grid->segments_y;
+}
+
+// Width in pixels of a column strip
+int qoi_grid_width(const qoi_grid_t *grid, const qoi_desc *desc, int chunk_x) {
+	if (chunk_x == grid->chunks_x - 1) {
+		return desc->width - (grid->chunks_x - 1) * QOI_CHUNK_W;
+	}
+	return QOI_CHUNK_W;
+}
+
+// Height in pixels of a chunk row
+int qoi_grid_height(const qoi_grid_t *grid, const qoi_desc *desc, int chunk_y) {
+	if (chunk_y == grid->chunks_y - 1) {
+		return desc->height - (grid->chunks_y - 1) * QOI_CHUNK_H;
+	}
+	return QOI_CHUNK_H;
+}
+
+// Number of pixels in a segment
+int qoi_grid_pixels(const qoi_grid_t *grid, const qoi_desc *desc, int segment) {
+	int chunk_x = segment / grid->segments_y;
+	int chunk_y = (segment % grid->segments_y) * grid->segment_rows;
+	int chunk_y_end = chunk_y + grid->segment_rows;
+	if (chunk_y_end >= grid->chunks_y) {
+		return qoi_grid_width(grid, desc, chunk_x) * (desc->height - chunk_y * QOI_CHUNK_H);
+	}
+	return qoi_grid_width(grid, desc, chunk_x) * grid->segment_rows * QOI_CHUNK_H;
+}
+
+int qoi_encode_valid(const qoi_desc *desc) {
+	return
+		desc->width != 0 && desc->height != 0 &&
+		desc->height < QOI_PIXELS_MAX / desc->width &&
+		(desc->channels == 1 || desc->channels == 3 || desc->channels == 4) &&
+		(desc->stride == 0 || desc->stride >= (int)desc->width * desc->channels) &&
+		(desc->layout == QOI_LAYOUT_RGBA || (desc->channels >= 3 && desc->layout == QOI_LAYOUT_BGRA) ||
+			(desc->channels == 4 && (desc->layout == QOI_LAYOUT_ARGB || desc->layout == QOI_LAYOUT_ALPHA))) &&
+		(desc->colorspace & 0xf0) == 0 &&
+		(desc->flags & ~(QOI_STRIP_TABLE | QOI_RESTARTS)) == 0 &&
+		desc->restart_interval >= 0;
+}
+
+// Bytes from one input row to the next
+int qoi_encode_stride(const qoi_desc *desc) {
+	return desc->stride ? desc->stride : (int)desc->width * desc->channels;
+}
+
+// Bytes per pixel of a stored chunk (QOI_RAW). Input without chroma is coded
+// in BW mode only, where that is the Y byte.
+int qoi_raw_size(const qoi_desc *desc) {
+	return desc->channels == 1 || desc->layout == QOI_LAYOUT_ALPHA ? 1 : 3;
+}
+
+int qoi_table_size(const qoi_grid_t *grid, const qoi_desc *desc) {
+	if (desc->flags & QOI_STRIP_TABLE) {
+		return grid->segments * 4;
+	}
+	return 0;
+}
+
+// Writes the header and the restart interval, if there is one, and returns
+// the position of the strip offset table.
+int qoi_encode_header(unsigned char *bytes, const qoi_desc *desc, const qoi_grid_t *grid) {
+	int flags = desc->flags & ~QOI_RESTARTS;
+	if (grid->segments_y > 1) {
+		flags |= QOI_RESTARTS;
+	}
+
+	int p = 0;
+	qoi_write_32(bytes, &p, QOI_MAGIC);
+	qoi_write_32(bytes, &p, desc->width);
+	qoi_write_32(bytes, &p, desc->height);
+	bytes[p++] = desc->channels;
+	bytes[p++] = desc->colorspace | flags;
+
+	if (flags & QOI_RESTARTS) {
+		qoi_write_32(bytes, &p, grid->segment_rows);
+	}
+	return p;
+}
+
+// Opcodes are put together in a register and written with one unaligned
+// store of 4 or 8 bytes, which may reach this many bytes past the opcode.
+#define QOI_ENC_SLACK 8
+
+// Writes the BW mode QOI_DIFF_16 opcode for `count` pending deltas, two to a
+// byte, and returns its length.
+int qoi_write_deltas(unsigned char *bytes, const int *deltas, int count) {
+	unsigned long long packed = 0;
+	int len = (count + 1) >> 1;
+	for (int i = 0; i < count; i += 2) {
+		int high = i + 1 < count ? deltas[i + 1] : 0;
+		packed = (packed << 8) | (unsigned char)(deltas[i] | (high << 4));
+	}
+
+	bytes[0] = QOI_DIFF_16 | (count - 1);
+	qoi_store_64(bytes + 1, packed << (64 - 8 * len));
+	return 1 + len;
+}
+
+// Writes a run of `run` pixels and returns its length. A run that fills the
+// rest of a chunk, whose last chunk_run pixels it covers at most, is a single
+// QOI_RUN_CHUNK.
+int qoi_write_run(unsigned char *bytes, int run, int chunk_run) {
+	if (run <= chunk_run) {
+		bytes[0] = QOI_RUN_CHUNK;
+		return 1;
+	}
+
+	// Runs of more than 1024 pixels, which would take a chain of 3 or more
+	// bytes, are written as QOI_RUN_LONG
+	int p = 0;
+	while (run > 1024) {
+		int n = run < (1 << 24) ? run : (1 << 24);
+		qoi_store_32(bytes + p, ((unsigned int)QOI_RUN_LONG << 24) | (unsigned int)(n - 1));
+		p += 4;
+		run -= n;
+	}
+
+	if (run > 0) {
+		// The QOI_RUN_8 chain, most significant group first
+		--run;
+		int len = 1;
+		while (run >> (5 * len)) {
+			len++;
+		}
+
+		unsigned long long chain = 0;
+		for (int k = len - 1; k >= 0; k--) {
+			chain = (chain << 8) | QOI_RUN_8 | ((run >> (5 * k)) & 0x1f);
+		}
+		qoi_store_64(bytes + p, chain << (64 - 8 * len));
+		p += len;
+	}
+	return p;
+}
+
+// Encodes one segment of a column strip and returns the number of bytes
+// written. The state is reset first with QOI_SEPARATE_COLUMNS or restart
+// intervals, so every segment is an independent stream.
+int qoi_encode_segment(qoi_enc_state_t *s, const unsigned char *pixels, const qoi_desc *desc, const qoi_grid_t *grid, int segment, unsigned char *bytes, stats_t *stats) {
+	int chunks_y_count = grid->chunks_y;
+	int channels = desc->channels;
+
+	int chunk_x = segment / grid->segments_y;
+	int chunk_y_start = (segment % grid->segments_y) * grid->segment_rows;
+	int chunk_y_end = chunk_y_start + grid->segment_rows;
+	if (chunk_y_end > chunks_y_count) {
+		chunk_y_end = chunks_y_count;
+	}
+
+	int x_pixels = qoi_grid_width(grid, desc, chunk_x);
+
+#ifndef QOI_SEPARATE_COLUMNS
+	if (grid->segments_y > 1)
+#endif
+	{
+		qoi_enc_state_reset(s, desc);
+		s->px_count = qoi_grid_pixels(grid, desc, segment);
+	}
+
+	// The last strip and the last chunk row take the remainder of the image
+	qoi_rgba_t tile[(2 * QOI_CHUNK_W) * (2 * QOI_CHUNK_H)];
+	unsigned char hashes[(2 * QOI_CHUNK_W) * (2 * QOI_CHUNK_H)];
+	qoi_rgba_t index_chunk[QOI_COLOR_CACHE_SIZE];
+	stats_t stats_chunk;
+	const qoi_kernels_t *kernels = qoi_get_kernels();
+	int stride = qoi_encode_stride(desc);
+	const unsigned char *end = pixels + (size_t)(desc->height - 1) * stride + desc->width * channels;
+	qoi_layout_t layout;
+	qoi_layout_init(&layout, desc);
+	qoi_rgba_t *index = s->index;
+	int *deltas = s->deltas;
+	qoi_rgba_t px_prev = s->px_prev;
+	qoi_rgba_t px = s->px;
+	int run = s->run;
+	int diffRun = s->diffRun;
+	int mode = s->mode;
+	int px_count = s->px_count;
+	int p = 0;
+
+	// Input without chroma only has gray chunks
+	int gray_image = qoi_raw_size(desc) == 1;
+	int prev_tile_len = 0;
+
+	for (int chunk_y = chunk_y_start; chunk_y < chunk_y_end; chunk_y++) {
+		int y_pixels = qoi_grid_height(grid, desc, chunk_y);
+
+		const unsigned char *chunk = pixels + (size_t)(chunk_y * QOI_CHUNK_H) * stride + chunk_x * QOI_CHUNK_W * channels;
+
+		if (chunk_y + 1 < chunk_y_end) {
+			qoi_prefetch_rows(
+				chunk + (size_t)y_pixels * stride, stride, x_pixels * channels,
+				qoi_grid_height(grid, desc, chunk_y + 1)
+			);
+		}
+
+		kernels->ycocg_chunk(chunk, end, stride, &layout, x_pixels, y_pixels, tile);
+
+		// Every chunk starts in the mode that suits it: BW for gray chunks,
+		// color for the others. A solid chunk is one pixel and a run, so it
+		// stays in the mode it finds unless it needs color, or the image is
+		// gray and all of it is BW mode. Gray images are still classified, so
+		// their solid chunks are found.
+		int tile_len = x_pixels * y_pixels;
+		int chunk_class = kernels->classify_tile(tile, tile_len) | (gray_image ? QOI_CHUNK_GRAY : 0);
+
+		// A solid chunk of the previous pixel only extends the run
+		if ((chunk_class & QOI_CHUNK_SOLID) && tile[0].v == px.v && px_count > tile_len) {
+			run += tile_len;
+			px_count -= tile_len;
+			QOI_STATS_ADD(count_run_8, tile_len);
+			prev_tile_len = tile_len;
+			continue;
+		}
+
+		int chunk_mode = (chunk_class & QOI_CHUNK_GRAY) != 0;
+		if (chunk_class == (QOI_CHUNK_GRAY | QOI_CHUNK_SOLID) && !gray_image) {
+			chunk_mode = mode;
+		}
+		if (chunk_mode != mode) {
+			mode = chunk_mode;
+			bytes[p++] = mode ? QOI_MODE_BW : QOI_MODE_COL;
+		}
+
+		// Only color mode uses the cache, and only the first pixel of a solid
+		// chunk gets that far
+		if (mode == 0) {
+			if (chunk_class & QOI_CHUNK_SOLID) {
+				hashes[0] = QOI_COLOR_HASH(tile[0]) % QOI_COLOR_CACHE_SIZE;
+			}
+			else {
+				kernels->hash_tile(tile, tile_len, hashes);
+			}
+			memcpy(index_chunk, index, sizeof(index_chunk));
+		}
+
+		// A chunk is stored verbatim behind QOI_RAW if its opcodes would take
+		// more bytes. The loop gives up as soon as they do, and the state from
+		// before the chunk, stats included, is brought back.
+		int raw_size = mode ? 1 : 3;
+		int p_limit = p + 1 + tile_len * raw_size;
+		int p_chunk = p;
+		memcpy(&stats_chunk, stats, sizeof(stats_t));
+		int run_chunk = run;
+		int px_count_chunk = px_count;
+		qoi_rgba_t px_chunk = px;
+
+		for (int i = 0; i < tile_len && p <= p_limit; i++, px_count--) {
+			if (tile[i].v == px.v) {
+				// Extend the run by all matching pixels at once. The last
+				// pixel of the segment is left to the loop, which flushes
+				// the run.
+				int n = kernels->match_run(tile + i, tile_len - i, px);
+				if (n > px_count - 1) {
+					n = px_count - 1;
+				}
+
+				if (n > 0) {
+					run += n;
+					QOI_STATS_ADD(count_run_8, n);
+					i += n - 1;
+					px_count -= n - 1;
+					continue;
+				}
+			}
+
+			px_prev = px;
+			px = tile[i];
+
+			int diffFromPrev = px.v != px_prev.v;
+			int flushRun = 0;
+
+			if (!diffFromPrev) {
+				run++;
+				flushRun = (px_count == 1);
+				QOI_STATS(count_run_8);
+
+				if (!flushRun) {
+					continue;
+				}
+			}
+			else {
+				flushRun = run > 0;
+			}
+
+			if (flushRun && diffRun > 0) {
+				// The run goes into the pending BW deltas as zeros if they
+				// have room for it, or after them otherwise
+				if (diffRun + run <= 16) {
+					while (run > 0) {
+						deltas[diffRun++] = 8;
+						run--;
+					}
+					flushRun = 0;
+				}
+				else {
+					p += qoi_write_deltas(bytes + p, deltas, diffRun);
+					diffRun = 0;
+				}
+			}
+
+			// The run ends in this chunk, or with the one before this pixel
+			if (flushRun) {
+				int chunk_run = !diffFromPrev ? i + 1 : i == 0 ? prev_tile_len : 0;
+				p += qoi_write_run(bytes + p, run, chunk_run);
+				run = 0;
+			}
+
+			if (!diffFromPrev) {
+				continue;
+			}
+
+			// Color mode
+			if (mode == 0) {
+				// The hash is precomputed, so the probe is one load from the
+				// live cache, which already holds the pixels written earlier in
+				// the chunk. A hit mask gathered up front would still need
+				// those writes tracked, and measured slower.
+				int index_pos = hashes[i];
+				QOI_STATS(count_hash_bucket[index_pos]);
+
+				if (index[index_pos].v == px.v) {
+					bytes[p++] = index_pos;
+					QOI_STATS(count_index);
+				}
+				else {
+					index[index_pos] = px;
+
+					int vr = px.rgba.r - px_prev.rgba.r;
+					int vg = px.rgba.g - px_prev.rgba.g;
+					int vb = px.rgba.b - px_prev.rgba.b;
+
+					// Color mode
+					if (
+						QOI_RANGE(vr, 64) &&
+						QOI_RANGE(vg, 32) && QOI_RANGE(vb, 32)
+						) {
+						if (
+							QOI_RANGE(vr, 2) &&
+							QOI_RANGE(vg, 2) && QOI_RANGE(vb, 2)
+							) {
+							bytes[p++] = QOI_DIFF_8 | ((vr + 2) << 4) | (vg + 2) << 2 | (vb + 2);
+							QOI_STATS(count_diff_8);
 						}
-						else if ((b1 & QOI_MASK_5) == QOI_DIFF_24) {
-							b1 <<= 16;
-							b1 |= bytes[p++] << 8;
-							b1 |= bytes[p++];
-
-							if (mode == 0) {
-								px.rgba.r += ((b1 >> 12) & 0x7f) - 64;
-								px.rgba.g += ((b1 >> 6) & 0x3f) - 32;
-								px.rgba.b += (b1 & 0x3f) - 32;
-							}
-							else {
-								px.rgba.r += ((b1 >> 10) & 0x1f) - 16;
-								px.rgba.g += ((b1 >> 5) & 0x1f) - 16;
-								px.rgba.b += (b1 & 0x1f) - 16;
-								px.rgba.a += ((b1 >> 15) & 0x1f) - 16;
+						else if (
+							QOI_RANGE(vr, 8) &&
+							QOI_RANGE(vg, 8) && QOI_RANGE(vb, 8)
+							) {
+							unsigned int value =
+								(QOI_DIFF_16 << 8) | ((vr + 8) << 8) |
+								((vg + 8) << 4) | (vb + 8);
+							qoi_store_32(bytes + p, value << 16);
+							p += 2;
+							QOI_STATS(count_diff_16);
+						}
+						else {
+							if (px.rgba.g == 128 && px.rgba.b == 128) {
+								goto encodecolor;
 							}
 
-							QOI_SAVE_COLOR(px);
-						}
-						else if ((b1 & QOI_MASK_5) == QOI_COLOR) {
-							if (b1 == QOI_COLOR_BW) {
-								px.rgba.r = bytes[p++];
-								px.rgba.g = px.rgba.b = 128;
-							}
-							else {
-								px.rgba.r = bytes[p++];
-								px.rgba.g = bytes[p++];
-								px.rgba.b = bytes[p++];
-							}
-							QOI_SAVE_COLOR(px);
+							unsigned int value =
+								(QOI_DIFF_24 << 16) | ((vr + 64) << 12) |
+								((vg + 32) << 6) | (vb + 32);
+
+							qoi_store_32(bytes + p, value << 8);
+							p += 3;
+							QOI_STATS(count_diff_24);
+						}
+					}
+					else {
+						goto encodecolor;
+					}
+				}
+			}
+			else if (mode == 1) {
+				int vr = px.rgba.r - px_prev.rgba.r;
+
+				if (QOI_RANGE(vr, 64)) {
+					if (QOI_RANGE(vr, 8)) {
+						if (diffRun == 16) {
+							p += qoi_write_deltas(bytes + p, deltas, diffRun);
+
+							diffRun = 0;
+						}
+
+						deltas[diffRun++] = vr + 8;
+					}
+					else {
+						if (diffRun > 0) {
+							p += qoi_write_deltas(bytes + p, deltas, diffRun);
+
+							diffRun = 0;
+						}
+
+						bytes[p++] = QOI_INDEX | (vr + 64);
+						QOI_STATS(count_index);
+					}
+				}
+				else {
+					if (diffRun > 0) {
+						p += qoi_write_deltas(bytes + p, deltas, diffRun);
+
+						diffRun = 0;
+					}
+
+					goto encodecolor;
+				}
+			}
+			else {
+				encodecolor: {
+					if (px.rgba.g == 128 && px.rgba.b == 128) {
+						qoi_store_32(bytes + p, ((unsigned int)QOI_COLOR_BW << 24) | (px.rgba.r << 16));
+						p += 2;
+					}
+					else {
+						qoi_store_32(bytes + p,
+							((unsigned int)QOI_COLOR << 24) | (px.rgba.r << 16) |
+							(px.rgba.g << 8) | px.rgba.b
+						);
+						p += 4;
+					}
+					QOI_STATS(count_color);
+				}
+			}
+		}
+	
+		// Delta groups end with the chunk, the decoder writes them to its tile
+		if (diffRun > 0 && p <= p_limit) {
+			p += qoi_write_deltas(bytes + p, deltas, diffRun);
+			diffRun = 0;
+		}
+
+		if (p > p_limit) {
+			// The run before the chunk, which ended with the one before it,
+			// and the pixels as they are
+			p = p_chunk;
+			if (run_chunk > 0) {
+				p += qoi_write_run(bytes + p, run_chunk, prev_tile_len);
+			}
+			bytes[p++] = QOI_RAW;
+			if (mode == 0) {
+				memcpy(index, index_chunk, sizeof(index_chunk));
+				for (int i = 0; i < tile_len; i++, p += 3) {
+					memcpy(bytes + p, tile + i, 4);
+				}
+			}
+			else {
+				for (int i = 0; i < tile_len; i++) {
+					bytes[p++] = tile[i].rgba.r;
+				}
+			}
+			memcpy(stats, &stats_chunk, sizeof(stats_t));
+			QOI_STATS(count_raw);
+
+			px_prev = tile_len > 1 ? tile[tile_len - 2] : px_chunk;
+			px = tile[tile_len - 1];
+			run = 0;
+			diffRun = 0;
+			px_count = px_count_chunk - tile_len;
+		}
+		prev_tile_len = tile_len;
+	}
+
+	s->px_prev = px_prev;
+	s->px = px;
+	s->run = run;
+	s->diffRun = diffRun;
+	s->mode = mode;
+	s->px_count = px_count;
+	return p;
+}
+
+// Worst case number of bytes written for a segment. Every pixel may be stored
+// behind QOI_RAW at qoi_raw_size() bytes, and every chunk adds at most 6 bytes
+// to that: 1 for a mode switch, 1 for the QOI_RAW opcode and 4 for the run
+// that ended with the chunk before it, one QOI_RUN_LONG for up to 2^24 pixels.
+// Longer runs take 4 more bytes per 2^24 pixels, which come out of the stored
+// bytes those pixels did not use.
+//
+// A chunk that falls back to QOI_RAW is coded until it passes its stored size,
+// and what it wrote is then thrown away. The last pixel coded may write up to
+// 15 bytes past that size: a BW delta group (9 bytes), the run it ends (4) and
+// its own opcode (2). In color mode no deltas are pending and the opcode takes
+// at most 4. QOI_RAW_OVERRUN rounds the 15 up to 16. QOI_ENC_SLACK covers the
+// wide store of the last opcode.
+#define QOI_CHUNK_BOUND 6
+#define QOI_RAW_OVERRUN 16
+
+int qoi_segment_bound(const qoi_grid_t *grid, const qoi_desc *desc, int segment) {
+	return
+		qoi_grid_pixels(grid, desc, segment) * qoi_raw_size(desc) +
+		grid->segment_rows * QOI_CHUNK_BOUND + QOI_RAW_OVERRUN + QOI_ENC_SLACK;
+}
+
+int qoi_encode_bound(const qoi_desc *desc) {
+	if (desc == NULL || !qoi_encode_valid(desc)) {
+		return 0;
+	}
+
+	qoi_grid_t grid;
+	qoi_grid_init(&grid, desc);
+
+	// The sum of qoi_segment_bound() over all segments
+	return
+		QOI_HEADER_SIZE + 4 + qoi_table_size(&grid, desc) +
+		desc->width * desc->height * qoi_raw_size(desc) +
+		grid.segments * (grid.segment_rows * QOI_CHUNK_BOUND + QOI_RAW_OVERRUN + QOI_ENC_SLACK) +
+		QOI_PADDING;
+}
+
+int qoi_encode_into(const void *data, const qoi_desc *desc, void *out, int out_size, stats_t *stats) {
+	stats_t empty_stats;
+
+	if (stats == NULL)
+		stats = &empty_stats;
+
+	memset(stats, 0, sizeof(stats_t));
+
+	if (
+		data == NULL || out == NULL || desc == NULL ||
+		!qoi_encode_valid(desc) ||
+		out_size < qoi_encode_bound(desc)
+	) {
+		return 0;
+	}
+
+	qoi_grid_t grid;
+	qoi_grid_init(&grid, desc);
+
+	unsigned char *bytes = (unsigned char *)out;
+	int table = qoi_encode_header(bytes, desc, &grid);
+	int start = table + qoi_table_size(&grid, desc);
+	int p = start;
+
+	const unsigned char *pixels = (const unsigned char *)data;
+	qoi_enc_state_t state;
+	qoi_enc_state_reset(&state, desc);
+
+	for (int segment = 0; segment < grid.segments; segment++) {
+		if (desc->flags & QOI_STRIP_TABLE) {
+			qoi_write_32(bytes, &table, p - start);
+		}
+		p += qoi_encode_segment(&state, pixels, desc, &grid, segment, bytes + p, stats);
+	}
+
+	for (int i = 0; i < QOI_PADDING; i++) {
+		bytes[p++] = 0;
+	}
+
+	return p;
+}
+
+void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len, stats_t *stats) {
+	if (out_len == NULL) {
+		return NULL;
+	}
+
+	int max_size = qoi_encode_bound(desc);
+	if (!max_size) {
+		return NULL;
+	}
+
+	unsigned char *bytes = QOI_MALLOC(max_size);
+	if (!bytes) {
+		return NULL;
+	}
+
+	int p = qoi_encode_into(data, desc, bytes, max_size, stats);
+	if (!p) {
+		QOI_FREE(bytes);
+		return NULL;
+	}
+
+	*out_len = p;
+	return bytes;
+}
+
+typedef struct {
+	const unsigned char *pixels;
+	const qoi_desc *desc;
+	const qoi_grid_t *grid;
+	unsigned char *bytes;
+	int *segment_pos;
+	int *segment_len;
+	stats_t *stats;
+} qoi_encode_job_t;
+
+void qoi_encode_job(void *ctx, int segment) {
+	qoi_encode_job_t *job = (qoi_encode_job_t *)ctx;
+	qoi_enc_state_t state;
+	stats_t empty_stats;
+	stats_t *stats = job->stats ? job->stats + segment : &empty_stats;
+
+	memset(stats, 0, sizeof(stats_t));
+	job->segment_len[segment] = qoi_encode_segment(
+		&state, job->pixels, job->desc, job->grid, segment,
+		job->bytes + job->segment_pos[segment], stats
+	);
+}
+
+void *qoi_encode_parallel(const void *data, const qoi_desc *desc, int *out_len, stats_t *stats, int threads) {
+	if (
+		data == NULL || out_len == NULL || desc == NULL ||
+		!qoi_encode_valid(desc)
+	) {
+		return NULL;
+	}
+
+	qoi_grid_t grid;
+	qoi_grid_init(&grid, desc);
+
+#ifndef QOI_SEPARATE_COLUMNS
+	if (grid.segments_y == 1) {
+		return qoi_encode(data, desc, out_len, stats);
+	}
+#endif
+
+	threads = qoi_thread_count(threads, grid.segments, desc->width * desc->height);
+	if (threads <= 1) {
+		return qoi_encode(data, desc, out_len, stats);
+	}
+
+	unsigned char *bytes = QOI_MALLOC(qoi_encode_bound(desc));
+	int *segment_pos = (int *)QOI_MALLOC(sizeof(int) * 2 * grid.segments);
+	stats_t *segment_stats = stats ? (stats_t *)QOI_MALLOC(sizeof(stats_t) * grid.segments) : NULL;
+	if (!bytes || !segment_pos || (stats && !segment_stats)) {
+		QOI_FREE(bytes);
+		QOI_FREE(segment_pos);
+		QOI_FREE(segment_stats);
+		return NULL;
+	}
+
+	int table = qoi_encode_header(bytes, desc, &grid);
+	int start = table + qoi_table_size(&grid, desc);
+	int p = start;
+
+	// Every segment gets its worst case slice of the output buffer. Segments
+	// are compacted in order afterwards; a segment never moves to the right,
+	// so memmove() can stitch them in place.
+	for (int segment = 0, pos = p; segment < grid.segments; segment++) {
+		segment_pos[segment] = pos;
+		pos += qoi_segment_bound(&grid, desc, segment);
+	}
+
+	qoi_encode_job_t job = {
+		.pixels = (const unsigned char *)data,
+		.desc = desc,
+		.grid = &grid,
+		.bytes = bytes,
+		.segment_pos = segment_pos,
+		.segment_len = segment_pos + grid.segments,
+		.stats = segment_stats
+	};
+	qoi_parallel_for(grid.segments, threads, qoi_encode_job, &job);
+
+	for (int segment = 0; segment < grid.segments; segment++) {
+		if (desc->flags & QOI_STRIP_TABLE) {
+			qoi_write_32(bytes, &table, p - start);
+		}
+		memmove(bytes + p, bytes + segment_pos[segment], job.segment_len[segment]);
+		p += job.segment_len[segment];
+	}
+
+	for (int i = 0; i < QOI_PADDING; i++) {
+		bytes[p++] = 0;
+	}
+
+	if (stats) {
+		memset(stats, 0, sizeof(stats_t));
+		unsigned int *sum = (unsigned int *)stats;
+		for (int segment = 0; segment < grid.segments; segment++) {
+			const unsigned int *part = (const unsigned int *)(segment_stats + segment);
+			for (int i = 0; i < (int)(sizeof(stats_t) / sizeof(unsigned int)); i++) {
+				sum[i] += part[i];
+			}
+		}
+		QOI_FREE(segment_stats);
+	}
+
+	QOI_FREE(segment_pos);
+	*out_len = p;
+	return bytes;
+}
+
+// -----------------------------------------------------------------------------
+// Decoder
+
+typedef struct {
+	qoi_rgba_t index[QOI_COLOR_CACHE_SIZE];
+	qoi_rgba_t px;
+	int run;
+	int mode;
+} qoi_dec_state_t;
+
+void qoi_dec_state_reset(qoi_dec_state_t *s) {
+	memset(s->index, 0, sizeof(qoi_rgba_t) * QOI_COLOR_CACHE_SIZE);
+	s->run = 0;
+	s->px.rgba.r = 0;
+	s->px.rgba.g = 0;
+	s->px.rgba.b = 0;
+	s->px.rgba.a = 255;
+	s->mode = 0;
+}
+
+// Reads and validates the header and fills desc. Returns the position of the
+// strip offset table (or the first segment, if there is no table) or 0 if the
+// header is invalid.
+int qoi_decode_header(const unsigned char *bytes, int size, qoi_desc *desc) {
+	int p = 0;
+
+	unsigned int header_magic = qoi_read_32(bytes, &p);
+	desc->width = qoi_read_32(bytes, &p);
+	desc->height = qoi_read_32(bytes, &p);
+	desc->channels = bytes[p++];
+	desc->colorspace = bytes[p++];
+	desc->flags = desc->colorspace & 0xf0;
+	desc->colorspace &= 0x0f;
+	desc->restart_interval = 0;
+	desc->stride = 0;
+	desc->layout = QOI_LAYOUT_RGBA;
+	desc->mode = 0;
+
+	if (desc->flags & QOI_RESTARTS) {
+		desc->restart_interval = (int)qoi_read_32(bytes, &p);
+	}
+
+	if (
+		desc->width == 0 || desc->height == 0 || 
+		desc->height >= QOI_PIXELS_MAX / desc->width ||
+		(desc->channels != 1 && desc->channels != 3 && desc->channels != 4) ||
+		(desc->flags & ~(QOI_STRIP_TABLE | QOI_RESTARTS)) != 0 ||
+		((desc->flags & QOI_RESTARTS) && desc->restart_interval <= 0) ||
+		header_magic != QOI_MAGIC
+	) {
+		return 0;
+	}
+
+	qoi_grid_t grid;
+	qoi_grid_init(&grid, desc);
+	if (p + qoi_table_size(&grid, desc) > size - QOI_PADDING) {
+		return 0;
+	}
+
+	return p;
+}
+
+// The window of the image a decoder writes to. Pixel (x, y) of the image is
+// stored in the output format at pixels + (y - y0) * stride + (x - x0) *
+// pixel size, everything outside of [x0, x1) x [y0, y1) is decoded but
+// dropped.
+typedef struct {
+	unsigned char *pixels;
+	int x0, y0, x1, y1;
+	int stride;
+	int format;
+} qoi_output_t;
+
+void qoi_output_init(qoi_output_t *out, unsigned char *pixels, int x, int y, int w, int h, int stride, int format) {
+	out->pixels = pixels;
+	out->x0 = x;
+	out->y0 = y;
+	out->x1 = x + w;
+	out->y1 = y + h;
+	out->stride = stride;
+	out->format = format;
+}
+
+// Returns the output format a decoder was asked for, with 0 resolved from the
+// header, or 0 if it is not one
+int qoi_output_format(int format, const qoi_desc *desc) {
+	switch (format) {
+		case 0:
+			return desc->channels;
+		case QOI_FORMAT_GRAY:
+		case QOI_FORMAT_GRAYA:
+		case QOI_FORMAT_RGB:
+		case QOI_FORMAT_RGBA:
+		case QOI_FORMAT_RGB565:
+		case QOI_FORMAT_BGR:
+		case QOI_FORMAT_BGRA:
+			return format;
+		default:
+			return 0;
+	}
+}
+
+// The opcode loop only reconstructs YCoCg pixels into a chunk tile (laid out
+// like the encoder's); they are converted back and stored row by row
+// afterwards. This keeps the transform out of the opcode loop's dependency
+// chain, and reading the tile only once the whole chunk is decoded avoids
+// stalls on store forwarding.
+
+// Converts the pixels x..x+count of row y from YCoCg and stores the ones inside
+// the window. With `reverse` the row is read back to front (odd chunk rows).
+void qoi_store_row(const qoi_output_t *out, int x, int y, int count, const qoi_rgba_t *row, int reverse, const qoi_kernels_t *kernels) {
+	if (y < out->y0 || y >= out->y1) {
+		return;
+	}
+
+	int from = x > out->x0 ? x : out->x0;
+	int to = x + count < out->x1 ? x + count : out->x1;
+	if (from >= to) {
+		return;
+	}
+
+	unsigned char *px_ptr = out->pixels + (y - out->y0) * out->stride + (from - out->x0) * QOI_FORMAT_SIZE(out->format);
+	row = reverse ? row + count - 1 - (from - x) : row + (from - x);
+	kernels->store_rgb(px_ptr, row, reverse ? -1 : 1, to - from, out->format);
+}
+
+// The decoder dispatches on a table, built at compile time, that gives the
+// opcode class of every first byte along with the deltas it holds. With GCC
+// and Clang every opcode jumps straight to the next one's code (computed
+// goto), elsewhere a switch compiles to a jump table.
+#define QOI_OP_INDEX    0
+#define QOI_OP_DIFF_8   1
+#define QOI_OP_RUN_8    2
+#define QOI_OP_DIFF_16  3
+#define QOI_OP_DIFF_24  4
+#define QOI_OP_COLOR_BW 5
+#define QOI_OP_COLOR    6
+#define QOI_OP_MODE     7
+#define QOI_OP_BW_DIFF  8
+#define QOI_OP_BW_GROUP 9
+#define QOI_OP_BW_COLOR 10
+#define QOI_OP_RUN_CHUNK 11
+#define QOI_OP_RUN_LONG 12
+#define QOI_OP_RAW      13
+
+typedef struct {
+	unsigned char op;
+	unsigned char dr, dg, db; // modulo 256
+} qoi_dec_op_t;
+
+#define QOI_DEC_OP(B) ( \
+	(B) < QOI_DIFF_8 ? QOI_OP_INDEX : \
+	(B) < QOI_RUN_8 ? QOI_OP_DIFF_8 : \
+	(B) < QOI_DIFF_16 ? QOI_OP_RUN_8 : \
+	(B) < QOI_DIFF_24 ? QOI_OP_DIFF_16 : \
+	(B) < QOI_COLOR ? QOI_OP_DIFF_24 : \
+	(B) == QOI_COLOR_BW ? QOI_OP_COLOR_BW : \
+	(B) == QOI_RUN_CHUNK ? QOI_OP_RUN_CHUNK : \
+	(B) == QOI_RUN_LONG ? QOI_OP_RUN_LONG : \
+	(B) == QOI_RAW ? QOI_OP_RAW : \
+	(B) == QOI_MODE_COL || (B) == QOI_MODE_BW ? QOI_OP_MODE : QOI_OP_COLOR)
+#define QOI_DEC_DR(B) (unsigned char)( \
+	QOI_DEC_OP(B) == QOI_OP_DIFF_8 ? (((B) >> 4) & 0x03) - 2 : \
+	QOI_DEC_OP(B) == QOI_OP_DIFF_16 ? ((B) & 0x0f) - 8 : 0)
+#define QOI_DEC_DG(B) (unsigned char)( \
+	QOI_DEC_OP(B) == QOI_OP_DIFF_8 ? (((B) >> 2) & 0x03) - 2 : 0)
+#define QOI_DEC_DB(B) (unsigned char)( \
+	QOI_DEC_OP(B) == QOI_OP_DIFF_8 ? ((B) & 0x03) - 2 : 0)
+#define QOI_DEC_ENTRY(B) { QOI_DEC_OP(B), QOI_DEC_DR(B), QOI_DEC_DG(B), QOI_DEC_DB(B) },
+
+// BW mode reads QOI_INDEX as a 7-bit luma delta, QOI_DIFF_16 as a group of
+// packed luma deltas and keeps QOI_COLOR_BW out of the cache
+#define QOI_DEC_OP_BW(B) ( \
+	(B) < QOI_DIFF_8 ? QOI_OP_BW_DIFF : \
+	(B) >= QOI_DIFF_16 && (B) < QOI_DIFF_24 ? QOI_OP_BW_GROUP : \
+	(B) == QOI_COLOR_BW ? QOI_OP_BW_COLOR : QOI_DEC_OP(B))
+#define QOI_DEC_DR_BW(B) (unsigned char)((B) < QOI_DIFF_8 ? (B) - 64 : QOI_DEC_DR(B))
+#define QOI_DEC_ENTRY_BW(B) { QOI_DEC_OP_BW(B), QOI_DEC_DR_BW(B), QOI_DEC_DG(B), QOI_DEC_DB(B) },
+
+#define QOI_X4(F, B) F(B) F((B) + 1) F((B) + 2) F((B) + 3)
+#define QOI_X16(F, B) QOI_X4(F, B) QOI_X4(F, (B) + 4) QOI_X4(F, (B) + 8) QOI_X4(F, (B) + 12)
+#define QOI_X64(F, B) QOI_X16(F, B) QOI_X16(F, (B) + 16) QOI_X16(F, (B) + 32) QOI_X16(F, (B) + 48)
+#define QOI_X256(F) QOI_X64(F, 0) QOI_X64(F, 64) QOI_X64(F, 128) QOI_X64(F, 192)
+
+static const qoi_dec_op_t qoi_dec_table[2][256] = {
+	{ QOI_X256(QOI_DEC_ENTRY) },
+	{ QOI_X256(QOI_DEC_ENTRY_BW) }
+};
+
+#if defined(__GNUC__) && !defined(QOI_NO_COMPUTED_GOTO)
+	#define QOI_COMPUTED_GOTO
+#endif
+
+// Opcodes up to pixel i_fast (see below) follow each other without going
+// through the checks at the top of the pixel loop. With computed goto every
+// opcode jumps to the next directly, a switch needs a loop of its own.
+#ifdef QOI_COMPUTED_GOTO
+	#define QOI_OPS_BEGIN {
+	#define QOI_OPS_END }
+	#define QOI_DISPATCH(OP) goto *qoi_dec_labels[OP];
+	#define QOI_CASE(OP) qoi_label_##OP
+	#define QOI_NEXT \
+		tile[i++] = px; \
+		if (i < i_fast) { \
+			b1 = bytes[p]; \
+			goto *qoi_dec_labels[table[b1].op]; \
+		} \
+		continue
+#else
+	#define QOI_OPS_BEGIN do {
+	#define QOI_OPS_END } while (i < i_fast);
+	#define QOI_DISPATCH(OP) switch (OP)
+	#define QOI_CASE(OP) case OP
+	#define QOI_NEXT \
+		tile[i++] = px; \
+		continue
+#endif
+
+// A QOI_RUN_8 chain is at most this long; 30 bits cover any pixel count. Longer
+// chains only occur in broken data and start a new run there.
+#define QOI_RUN_MAX_BYTES 6
+
+// No opcode but a BW delta group is longer than this, and the decoder reads
+// this many bytes at once. A group takes at most 2 bytes per pixel, a stored
+// chunk checks its length itself.
+// While the data holds this many bytes for every pixel left to decode, the
+// opcode loop runs without checking for its end.
+#define QOI_DEC_MARGIN 8
+
+// Like qoi_load_64, but for the last bytes of the data: nothing at or past
+// `end` is read, zeros take its place.
+unsigned long long qoi_load_64_tail(const unsigned char *bytes, int p, int end) {
+	unsigned long long v = 0;
+	for (int i = 0; i < 8; i++) {
+		v = (v << 8) | (p + i < end ? bytes[p + i] : 0);
+	}
+	return v;
+}
+
+// Multi-byte opcodes are taken apart from one word holding the opcode at p and
+// the bytes after it, with the first byte in the top bits.
+#define QOI_LOAD_WORD() (tail \
+	? qoi_load_64_tail(bytes, p, chunks_len + QOI_PADDING) \
+	: qoi_load_64(bytes + p))
+
+// Repeats the pixel from FROM up to TO in the tile. A few pixels are stored in
+// place, which is cheaper than calling the fill kernel.
+#define QOI_FILL_INLINE 8
+#define QOI_FILL(FROM, TO) \
+	if ((TO) - (FROM) <= QOI_FILL_INLINE) { \
+		for (int k = (FROM); k < (TO); k++) { \
+			tile[k] = px; \
+		} \
+	} \
+	else { \
+		kernels->fill(tile + (FROM), (TO) - (FROM), px); \
+	}
+
+// Decodes one segment of a column strip starting at byte p, down to pixel row
+// `rows` of the image at most, and returns the position after the last chunk
+// read. Pass desc->height to get the start of the next segment. The state is
+// reset first with QOI_SEPARATE_COLUMNS or restart intervals, so segments can
+// be decoded in any order.
+int qoi_decode_segment(qoi_dec_state_t *s, const unsigned char *bytes, int p, int chunks_len, const qoi_desc *desc, const qoi_grid_t *grid, int segment, int rows, const qoi_output_t *out) {
+	int chunk_x = segment / grid->segments_y;
+	int chunk_y_start = (segment % grid->segments_y) * grid->segment_rows;
+	int chunk_y_end = chunk_y_start + grid->segment_rows;
+	if (chunk_y_end > (rows - 1) / QOI_CHUNK_H + 1) {
+		chunk_y_end = (rows - 1) / QOI_CHUNK_H + 1;
+	}
+	if (chunk_y_end > grid->chunks_y) {
+		chunk_y_end = grid->chunks_y;
+	}
+
+	int x_pixels = qoi_grid_width(grid, desc, chunk_x);
+
+#ifndef QOI_SEPARATE_COLUMNS
+	if (grid->segments_y > 1)
+#endif
+	{
+		qoi_dec_state_reset(s);
+	}
+
+	qoi_rgba_t *index = s->index;
+	qoi_rgba_t px = s->px;
+	int run = s->run;
+	int mode = s->mode;
+	const qoi_dec_op_t *table = qoi_dec_table[mode];
+	const qoi_kernels_t *kernels = qoi_get_kernels();
+
+#ifdef QOI_COMPUTED_GOTO
+	static const void *const qoi_dec_labels[] = {
+		&&qoi_label_QOI_OP_INDEX, &&qoi_label_QOI_OP_DIFF_8,
+		&&qoi_label_QOI_OP_RUN_8, &&qoi_label_QOI_OP_DIFF_16,
+		&&qoi_label_QOI_OP_DIFF_24, &&qoi_label_QOI_OP_COLOR_BW,
+		&&qoi_label_QOI_OP_COLOR, &&qoi_label_QOI_OP_MODE,
+		&&qoi_label_QOI_OP_BW_DIFF, &&qoi_label_QOI_OP_BW_GROUP,
+		&&qoi_label_QOI_OP_BW_COLOR, &&qoi_label_QOI_OP_RUN_CHUNK,
+		&&qoi_label_QOI_OP_RUN_LONG, &&qoi_label_QOI_OP_RAW
+	};
+#endif
+
+	// The last strip and the last chunk row take the remainder of the image.
+	// BW delta groups and fills may write 16 pixels past the end of the chunk.
+	qoi_rgba_t tile[(2 * QOI_CHUNK_W) * (2 * QOI_CHUNK_H) + 16];
+	unsigned char packed_tail[8];
+
+	for (int chunk_y = chunk_y_start; chunk_y < chunk_y_end; chunk_y++) {
+		int y_pixels = qoi_grid_height(grid, desc, chunk_y);
+		int tile_len = x_pixels * y_pixels;
+
+		for (int i = 0; i < tile_len;) {
+			if (run > 0) {
+				// Repeat the pixel up to the end of the run or of the chunk
+				int end = run < tile_len - i ? i + run : tile_len;
+				run -= end - i;
+				QOI_FILL(i, end);
+				i = end;
+				continue;
+			}
+
+			// Every opcode yields at least one pixel, so none of the ones up to
+			// pixel i_fast can reach the end of the data. Past that point each
+			// opcode goes through the checks below on its own.
+			int i_fast = i + (chunks_len - p) / QOI_DEC_MARGIN;
+			int tail = 0;
+			if (i_fast > tile_len) {
+				i_fast = tile_len;
+			}
+			else if (i_fast <= i) {
+				if (p >= chunks_len) {
+					// Truncated data repeats the last pixel
+					tile[i++] = px;
+					continue;
+				}
+				i_fast = i + 1;
+				tail = 1;
+			}
+
+			unsigned long long w;
+			QOI_OPS_BEGIN
+				int b1 = bytes[p];
+				QOI_DISPATCH(table[b1].op) {
+					QOI_CASE(QOI_OP_INDEX):
+						p += 1;
+						px = index[b1];
+						QOI_NEXT;
+
+					QOI_CASE(QOI_OP_DIFF_8):
+						p += 1;
+						px.rgba.r += table[b1].dr;
+						px.rgba.g += table[b1].dg;
+						px.rgba.b += table[b1].db;
+						QOI_SAVE_COLOR(px);
+						QOI_NEXT;
+
+					QOI_CASE(QOI_OP_RUN_8): {
+						w = QOI_LOAD_WORD();
+						// The chain ends within the word, or at the end of the data
+						int end = chunks_len - p < QOI_RUN_MAX_BYTES ? chunks_len - p : QOI_RUN_MAX_BYTES;
+						int n = 1;
+						run = b1 & 0x1f;
+						w <<= 8;
+						while (n < end && (w >> 61) == (QOI_RUN_8 >> 5)) {
+							run = (run << 5) | (int)((w >> 56) & 0x1f);
+							w <<= 8;
+							n++;
 						}
+						p += n;
+
+						// Repeat the pixel up to the end of the chunk, the rest
+						// of the run is filled above
+						end = run < tile_len - i - 1 ? i + run : tile_len - 1;
+						run -= end - i;
+						QOI_FILL(i, end);
+						i = end;
+						QOI_NEXT;
+					}
 
-						int tmp = (int)px.rgba.r - ((int)px.rgba.b - 128);
-						pxRGB.rgba.g = 2 * ((int)px.rgba.b - 128) + tmp;
-						pxRGB.rgba.b = tmp - ((int)px.rgba.g - 128) / 2;
-						pxRGB.rgba.r = pxRGB.rgba.b + 2 * ((int)px.rgba.g - 128);
-						pxRGB.rgba.a = px.rgba.a;
+					QOI_CASE(QOI_OP_RUN_LONG): {
+						w = QOI_LOAD_WORD();
+						p += 4;
+						run = (int)((w >> 32) & 0xffffff);
+						int end = run < tile_len - i - 1 ? i + run : tile_len - 1;
+						run -= end - i;
+						QOI_FILL(i, end);
+						i = end;
+						QOI_NEXT;
 					}
 
-					if (channels == 4) {
-						memcpy(px_ptr, &pxRGB, 4);
+					QOI_CASE(QOI_OP_RUN_CHUNK):
+						p += 1;
+						QOI_FILL(i, tile_len);
+						i = tile_len - 1;
+						QOI_NEXT;
+
+					QOI_CASE(QOI_OP_DIFF_16):
+						w = QOI_LOAD_WORD();
+						p += 2;
+						px.rgba.r += table[b1].dr;
+						px.rgba.g += ((w >> 52) & 0x0f) - 8;
+						px.rgba.b += ((w >> 48) & 0x0f) - 8;
+						QOI_SAVE_COLOR(px);
+						QOI_NEXT;
+
+					QOI_CASE(QOI_OP_DIFF_24):
+						w = QOI_LOAD_WORD();
+						p += 3;
+						b1 = (int)(w >> 40);
+
+						if (mode == 0) {
+							px.rgba.r += ((b1 >> 12) & 0x7f) - 64;
+							px.rgba.g += ((b1 >> 6) & 0x3f) - 32;
+							px.rgba.b += (b1 & 0x3f) - 32;
+						}
+						else {
+							px.rgba.r += ((b1 >> 10) & 0x1f) - 16;
+							px.rgba.g += ((b1 >> 5) & 0x1f) - 16;
+							px.rgba.b += (b1 & 0x1f) - 16;
+							px.rgba.a += ((b1 >> 15) & 0x1f) - 16;
+						}
+						QOI_SAVE_COLOR(px);
+						QOI_NEXT;
+
+					QOI_CASE(QOI_OP_COLOR_BW):
+						w = QOI_LOAD_WORD();
+						p += 2;
+						px.rgba.r = (unsigned char)(w >> 48);
+						px.rgba.g = px.rgba.b = 128;
+						QOI_SAVE_COLOR(px);
+						QOI_NEXT;
+
+					QOI_CASE(QOI_OP_COLOR):
+						w = QOI_LOAD_WORD();
+						p += 4;
+						px.rgba.r = (unsigned char)(w >> 48);
+						px.rgba.g = (unsigned char)(w >> 40);
+						px.rgba.b = (unsigned char)(w >> 32);
+						QOI_SAVE_COLOR(px);
+						QOI_NEXT;
+
+					QOI_CASE(QOI_OP_MODE):
+						// Yields no pixel, so the checks above come first again
+						p += 1;
+						mode = b1 == QOI_MODE_BW;
+						table = qoi_dec_table[mode];
+						i_fast = i;
+						continue;
+
+					QOI_CASE(QOI_OP_BW_DIFF):
+						p += 1;
+						px.rgba.r += table[b1].dr;
+						px.rgba.g = px.rgba.b = 128;
+						QOI_NEXT;
+
+					QOI_CASE(QOI_OP_BW_GROUP): {
+						// Groups end with the chunk, broken ones are cut there
+						int n = (b1 & 0x0f) + 1;
+						const unsigned char *packed = bytes + p + 1;
+						if (tail) {
+							qoi_store_64(packed_tail, qoi_load_64_tail(bytes, p + 1, chunks_len + QOI_PADDING));
+							packed = packed_tail;
+						}
+						p += 1 + ((n + 1) >> 1);
+						if (n > tile_len - i) {
+							n = tile_len - i;
+						}
+						kernels->unpack_deltas(tile + i, packed, n, px);
+						i += n - 1;
+						px = tile[i];
+						QOI_NEXT;
 					}
-					else {
-						px_ptr[0] = pxRGB.rgba.r;
-						px_ptr[1] = pxRGB.rgba.g;
-						px_ptr[2] = pxRGB.rgba.b;
+
+					QOI_CASE(QOI_OP_BW_COLOR):
+						w = QOI_LOAD_WORD();
+						p += 2;
+						px.rgba.r = (unsigned char)(w >> 48);
+						px.rgba.g = px.rgba.b = 128;
+						QOI_NEXT;
+
+					QOI_CASE(QOI_OP_RAW): {
+						// The rest of the chunk, as much of it as the data holds
+						int size = mode ? 1 : 3;
+						const unsigned char *raw = bytes + p + 1;
+						int n = tile_len - i;
+						if (n * size > chunks_len - p - 1) {
+							n = (chunks_len - p - 1) / size;
+							p = chunks_len;
+						}
+						else {
+							p += 1 + n * size;
+						}
+						if (n > 0) {
+							kernels->load_raw(tile + i, raw, n, size, px);
+							i += n - 1;
+							px = tile[i];
+						}
+						QOI_NEXT;
 					}
 				}
-			
-				px_ptr += desc->width * desc->channels - inc;
+			QOI_OPS_END
+		}
+
+		for (int y = 0; y < y_pixels; y++) {
+			// Odd rows run right to left
+			qoi_store_row(out, chunk_x * QOI_CHUNK_W, chunk_y * QOI_CHUNK_H + y, x_pixels, tile + y * x_pixels, y & 1, kernels);
+		}
+	}
+
+	s->px = px;
+	s->run = run;
+	s->mode = mode;
+	return p;
+}
+
+// Opcode lengths and pixel counts for the stream scanner, one table per mode,
+// built at compile time. An entry is (pixels << 4) | bytes; zero marks the
+// opcodes that need a closer look (runs, stored chunks and mode switches).
+#define QOI_SCAN_BYTES(B, M) ( \
+	(B) < QOI_RUN_8 ? 1 : \
+	(B) < QOI_DIFF_16 ? 0 : \
+	(B) < QOI_DIFF_24 ? ((M) ? 1 + ((((B) & 0x0f) + 2) >> 1) : 2) : \
+	(B) < QOI_COLOR ? 3 : \
+	(B) == QOI_COLOR_BW ? 2 : \
+	(B) == QOI_RUN_CHUNK || (B) == QOI_RUN_LONG || (B) == QOI_RAW || \
+	(B) == QOI_MODE_COL || (B) == QOI_MODE_BW ? 0 : 4)
+#define QOI_SCAN_PIXELS(B, M) \
+	((B) >= QOI_DIFF_16 && (B) < QOI_DIFF_24 && (M) ? ((B) & 0x0f) + 1 : 1)
+#define QOI_SCAN_ENTRY(B, M) \
+	(QOI_SCAN_BYTES(B, M) ? (QOI_SCAN_PIXELS(B, M) << 4) | QOI_SCAN_BYTES(B, M) : 0)
+
+#define QOI_SCAN_COL(B) QOI_SCAN_ENTRY(B, 0),
+#define QOI_SCAN_BW(B) QOI_SCAN_ENTRY(B, 1),
+
+static const unsigned short qoi_scan_table[2][256] = {
+	{ QOI_X256(QOI_SCAN_COL) },
+	{ QOI_X256(QOI_SCAN_BW) }
+};
+
+// Walks one column strip of px_count pixels, in chunks of chunk_px pixels,
+// using only the opcode lengths and run counts - no color transform, no index
+// updates, no pixel writes - and returns the position after it, or -1 if the
+// strip runs past the data.
+int qoi_scan_column(const unsigned char *bytes, int p, int chunks_len, int chunk_px, int px_count) {
+	const unsigned short *table = qoi_scan_table[0];
+	int total = px_count;
+
+	while (px_count > 0) {
+		if (p >= chunks_len) {
+			return -1;
+		}
+
+		int b1 = bytes[p];
+		int entry = table[b1];
+
+		if (entry) {
+			p += entry & 0x0f;
+			px_count -= entry >> 4;
+		}
+		else if ((b1 & QOI_MASK_3) == QOI_RUN_8) {
+			int run = b1 & 0x1f;
+			int end = p + QOI_RUN_MAX_BYTES < chunks_len ? p + QOI_RUN_MAX_BYTES : chunks_len;
+			while (++p < end && (bytes[p] & QOI_MASK_3) == QOI_RUN_8) {
+				run = (run << 5) + (bytes[p] & 0x1f);
+			}
+			px_count -= run + 1;
+		}
+		else if (b1 == QOI_RUN_CHUNK || b1 == QOI_RAW) {
+			// The last chunk takes the remainder of the strip
+			int end = ((total - px_count) / chunk_px + 1) * chunk_px;
+			int left = total - end < chunk_px ? 0 : total - end;
+			if (b1 == QOI_RAW) {
+				p += (px_count - left) * (table == qoi_scan_table[1] ? 1 : 3);
+			}
+			px_count = left;
+			p++;
+		}
+		else if (b1 == QOI_RUN_LONG) {
+			// Within the padding even at the end of the data
+			px_count -= ((bytes[p + 1] << 16) | (bytes[p + 2] << 8) | bytes[p + 3]) + 1;
+			p += 4;
+		}
+		else {
+			table = qoi_scan_table[b1 == QOI_MODE_BW];
+			p++;
+		}
+	}
+
+	return px_count == 0 ? p : -1;
+}
+
+// Fills offsets[0..count-1] with the start of the first count segments,
+// relative to the first one. They are taken from the strip offset table if
+// there is one and found with qoi_scan_column otherwise. Returns 0 on invalid
+// data.
+int qoi_strip_offsets(const unsigned char *bytes, int table, int chunks_len, const qoi_desc *desc, const qoi_grid_t *grid, unsigned int *offsets, int count) {
+	int start = table + qoi_table_size(grid, desc);
+
+	if (desc->flags & QOI_STRIP_TABLE) {
+		for (int i = 0; i < count; i++) {
+			offsets[i] = qoi_read_32(bytes, &table);
+			if (offsets[i] >= (unsigned int)(chunks_len - start)) {
+				return 0;
 			}
 		}
+		return 1;
+	}
+
+	int p = start;
+
+	for (int i = 0; i < count; i++) {
+		if (p < 0 || p >= chunks_len) {
+			return 0;
+		}
+		offsets[i] = p - start;
+		if (i < count - 1) {
+			int chunk_px = qoi_grid_width(grid, desc, i / grid->segments_y) * QOI_CHUNK_H;
+			p = qoi_scan_column(bytes, p, chunks_len, chunk_px, qoi_grid_pixels(grid, desc, i));
+		}
+	}
+	return 1;
+}
+
+int qoi_decode_into(const void *data, int size, qoi_desc *desc, void *out, int out_stride, int format) {
+	if (
+		data == NULL || desc == NULL ||
+		size < QOI_HEADER_SIZE + QOI_PADDING
+	) {
+		return 0;
+	}
+
+	const unsigned char *bytes = (const unsigned char *)data;
+	int p = qoi_decode_header(bytes, size, desc);
+	if (!p) {
+		return 0;
+	}
+
+	format = qoi_output_format(format, desc);
+	if (!format) {
+		return 0;
+	}
+
+	int row_len = desc->width * QOI_FORMAT_SIZE(format);
+	if (out_stride == 0) {
+		out_stride = row_len;
+	}
+	if (out_stride < row_len || out_stride > (0x7fffffff - row_len) / (int)desc->height) {
+		return 0;
+	}
+
+	// The output spans this many bytes
+	int out_len = out_stride * ((int)desc->height - 1) + row_len;
+	if (out == NULL) {
+		return out_len;
+	}
+
+	qoi_output_t o;
+	qoi_output_init(&o, (unsigned char *)out, 0, 0, desc->width, desc->height, out_stride, format);
+
+	qoi_dec_state_t state;
+	qoi_dec_state_reset(&state);
+
+	qoi_grid_t grid;
+	qoi_grid_init(&grid, desc);
+
+	int chunks_len = size - QOI_PADDING;
+
+	p += qoi_table_size(&grid, desc);
+	for (int segment = 0; segment < grid.segments; segment++) {
+		p = qoi_decode_segment(&state, bytes, p, chunks_len, desc, &grid, segment, desc->height, &o);
+	}
+
+	return out_len;
+}
+
+void *qoi_decode(const void *data, int size, qoi_desc *desc, int format) {
+	int px_len = qoi_decode_into(data, size, desc, NULL, 0, format);
+	if (!px_len) {
+		return NULL;
+	}
+
+	unsigned char *pixels = QOI_MALLOC(px_len);
+	if (!pixels) {
+		return NULL;
+	}
+
+	qoi_decode_into(data, size, desc, pixels, 0, format);
+	return pixels;
+}
+
+typedef struct {
+	const unsigned char *bytes;
+	const qoi_desc *desc;
+	const qoi_grid_t *grid;
+	qoi_output_t out;
+	const unsigned int *offsets;
+	int start;
+	int chunks_len;
+} qoi_decode_job_t;
+
+void qoi_decode_job(void *ctx, int segment) {
+	qoi_decode_job_t *job = (qoi_decode_job_t *)ctx;
+	qoi_dec_state_t state;
+
+	int p = job->start + (int)job->offsets[segment];
+	qoi_decode_segment(
+		&state, job->bytes, p, job->chunks_len, job->desc, job->grid, segment,
+		job->desc->height, &job->out
+	);
+}
+
+void *qoi_decode_parallel(const void *data, int size, qoi_desc *desc, int format, int threads) {
+	if (
+		data == NULL || desc == NULL ||
+		size < QOI_HEADER_SIZE + QOI_PADDING
+	) {
+		return NULL;
+	}
+
+	const unsigned char *bytes = (const unsigned char *)data;
+	int table = qoi_decode_header(bytes, size, desc);
+	if (!table || !qoi_output_format(format, desc)) {
+		return NULL;
+	}
+
+	qoi_grid_t grid;
+	qoi_grid_init(&grid, desc);
+
+#ifndef QOI_SEPARATE_COLUMNS
+	// Without independent strips only restart segments can be decoded apart
+	if (grid.segments_y == 1) {
+		return qoi_decode(data, size, desc, format);
+	}
+#endif
+
+	threads = qoi_thread_count(threads, grid.segments, desc->width * desc->height);
+	if (threads <= 1) {
+		return qoi_decode(data, size, desc, format);
+	}
+
+	int start = table + qoi_table_size(&grid, desc);
+	int chunks_len = size - QOI_PADDING;
+
+	// Without a strip offset table the segments are found with a quick scan
+	unsigned int *offsets = (unsigned int *)QOI_MALLOC(sizeof(unsigned int) * grid.segments);
+	if (!offsets) {
+		return NULL;
+	}
+	if (!qoi_strip_offsets(bytes, table, chunks_len, desc, &grid, offsets, grid.segments)) {
+		// Broken data, which the serial decoder gets as much out of as it can
+		QOI_FREE(offsets);
+		return qoi_decode(data, size, desc, format);
+	}
+
+	format = qoi_output_format(format, desc);
+	int px_len = desc->width * desc->height * QOI_FORMAT_SIZE(format);
+	unsigned char *pixels = QOI_MALLOC(px_len);
+	if (!pixels) {
+		QOI_FREE(offsets);
+		return NULL;
 	}
 
+	qoi_output_t out;
+	qoi_output_init(&out, pixels, 0, 0, desc->width, desc->height, desc->width * QOI_FORMAT_SIZE(format), format);
+
+	qoi_decode_job_t job = {
+		.bytes = bytes,
+		.desc = desc,
+		.grid = &grid,
+		.out = out,
+		.offsets = offsets,
+		.start = start,
+		.chunks_len = chunks_len
+	};
+	qoi_parallel_for(grid.segments, threads, qoi_decode_job, &job);
+
+	QOI_FREE(offsets);
 	return pixels;
 }
 
+int qoi_decode_region(const void *data, int size, qoi_desc *desc, int x, int y, int w, int h, void *out, int format) {
+	if (
+		data == NULL || desc == NULL || out == NULL ||
+		size < QOI_HEADER_SIZE + QOI_PADDING
+	) {
+		return 0;
+	}
+
+	const unsigned char *bytes = (const unsigned char *)data;
+	int table = qoi_decode_header(bytes, size, desc);
+	if (
+		!table || x < 0 || y < 0 || w <= 0 || h <= 0 ||
+		(unsigned int)x + w > desc->width || (unsigned int)y + h > desc->height
+	) {
+		return 0;
+	}
+
+	format = qoi_output_format(format, desc);
+	if (!format) {
+		return 0;
+	}
+
+	qoi_output_t o;
+	qoi_output_init(&o, (unsigned char *)out, x, y, w, h, w * QOI_FORMAT_SIZE(format), format);
+
+	qoi_grid_t grid;
+	qoi_grid_init(&grid, desc);
+
+	int first = x / QOI_CHUNK_W;
+	int last = (x + w - 1) / QOI_CHUNK_W;
+	if (first > grid.chunks_x - 1) {
+		first = grid.chunks_x - 1;
+	}
+	if (last > grid.chunks_x - 1) {
+		last = grid.chunks_x - 1;
+	}
+
+	int seg_first = y / QOI_CHUNK_H;
+	int seg_last = (y + h - 1) / QOI_CHUNK_H;
+	if (seg_first > grid.chunks_y - 1) {
+		seg_first = grid.chunks_y - 1;
+	}
+	if (seg_last > grid.chunks_y - 1) {
+		seg_last = grid.chunks_y - 1;
+	}
+	seg_first /= grid.segment_rows;
+	seg_last /= grid.segment_rows;
+
+	int start = table + qoi_table_size(&grid, desc);
+	int chunks_len = size - QOI_PADDING;
+
+	qoi_dec_state_t state;
+	qoi_dec_state_reset(&state);
+
+#ifdef QOI_SEPARATE_COLUMNS
+	// Segments are found through the strip offset table or a quick scan, so
+	// only those overlapping the rectangle are decoded and each one can stop
+	// after the last row of the rectangle. Broken data, where they can't be
+	// found, is decoded in order below.
+	int count = last * grid.segments_y + seg_last + 1;
+	unsigned int *offsets = (unsigned int *)QOI_MALLOC(sizeof(unsigned int) * count);
+	if (!offsets) {
+		return 0;
+	}
+	if (qoi_strip_offsets(bytes, table, chunks_len, desc, &grid, offsets, count)) {
+		for (int chunk_x = first; chunk_x <= last; chunk_x++) {
+			for (int seg = seg_first; seg <= seg_last; seg++) {
+				int segment = chunk_x * grid.segments_y + seg;
+				qoi_decode_segment(&state, bytes, start + offsets[segment], chunks_len, desc, &grid, segment, y + h, &o);
+			}
+		}
+
+		QOI_FREE(offsets);
+		return w * h * QOI_FORMAT_SIZE(format);
+	}
+	QOI_FREE(offsets);
+#endif
+
+	// Without independent strips or their offsets, all segments up to the
+	// rectangle have to be decoded; only the last one can stop early.
+	int end = last * grid.segments_y + seg_last;
+	for (int segment = 0, p = start; segment <= end; segment++) {
+		int rows = segment == end ? y + h : (int)desc->height;
+		p = qoi_decode_segment(&state, bytes, p, chunks_len, desc, &grid, segment, rows, &o);
+	}
+
+	return w * h * QOI_FORMAT_SIZE(format);
+}
+
+int qoi_index_strips(const void *data, int size, qoi_desc *desc, unsigned int *offsets, int max_offsets) {
+	if (
+		data == NULL || desc == NULL || offsets == NULL ||
+		size < QOI_HEADER_SIZE + QOI_PADDING
+	) {
+		return 0;
+	}
+
+	const unsigned char *bytes = (const unsigned char *)data;
+	int table = qoi_decode_header(bytes, size, desc);
+	if (!table) {
+		return 0;
+	}
+
+	qoi_grid_t grid;
+	qoi_grid_init(&grid, desc);
+	if (
+		grid.segments > max_offsets ||
+		!qoi_strip_offsets(bytes, table, size - QOI_PADDING, desc, &grid, offsets, grid.segments)
+	) {
+		return 0;
+	}
+
+	return grid.segments;
+}
+
 #ifndef QOI_NO_STDIO
 #include <stdio.h>
 
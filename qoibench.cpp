@@ -4,7 +4,7 @@ Simple benchmark suite for png, stbi and qoi
 
 Requires libpng, "stb_image.h" and "stb_image_write.h"
 Compile with: 
-	gcc qoibench.c -std=gnu99 -lpng -O3 -o qoibench 
+	gcc qoibench.c -std=gnu99 -lpng -lpthread -O3 -o qoibench 
 
 Dominic Szablewski - https://phoboslab.org
 
@@ -329,6 +329,7 @@ struct benchmark_conf {
 	bool decode = true;
 	bool alphaToBW = false;
 	bool saveQOI = false;
+	int threads = 1;
 };
 
 // Run __VA_ARGS__ a number of times and meassure the time taken. The first
@@ -357,15 +358,26 @@ benchmark_result_t benchmark_image(const char* path, int runs, benchmark_conf co
 	void *pixels = (void *)stbi_load(path, &w, &h, NULL, 4);
 	void *encoded_png = fload(path, &encoded_png_size);
 
-	if (conf.alphaToBW)
-	{
-		unsigned char* px_ptr = (unsigned char*)pixels;
-		for (int i = 0, S = w * h; i < S; ++i, px_ptr += 4) {
-			px_ptr[0] = px_ptr[3];
-			px_ptr[1] = px_ptr[3];
-			px_ptr[2] = px_ptr[3];
-			px_ptr[3] = 255;
+	if (!pixels || !encoded_png) {
+		QOI_ERROR("Error decoding %s\n", path);
+	}
+
+	// QOI reads the alpha mask straight from the pixels (QOI_LAYOUT_ALPHA),
+	// the PNG encoders get the same gray image in a buffer of its own
+	void *ref_pixels = pixels;
+	if (conf.alphaToBW) {
+		unsigned char *src = (unsigned char *)pixels;
+		unsigned char *dst = (unsigned char *)malloc((size_t)w * h * 4);
+		if (!dst) {
+			QOI_ERROR("Malloc for %d bytes failed", w * h * 4);
 		}
+		for (int i = 0, S = w * h; i < S; ++i) {
+			dst[i * 4 + 0] = src[i * 4 + 3];
+			dst[i * 4 + 1] = src[i * 4 + 3];
+			dst[i * 4 + 2] = src[i * 4 + 3];
+			dst[i * 4 + 3] = 255;
+		}
+		ref_pixels = dst;
 	}
 
 	auto desc = qoi_desc{
@@ -373,7 +385,9 @@ benchmark_result_t benchmark_image(const char* path, int runs, benchmark_conf co
 		.height = (unsigned int)h,
 		.channels = 4,
 		.colorspace = QOI_SRGB,
-		.mode = 1
+		// The strip table lets worker threads start decoding without a scan
+		.flags = conf.threads != 1 ? QOI_STRIP_TABLE : 0,
+		.layout = conf.alphaToBW ? QOI_LAYOUT_ALPHA : QOI_LAYOUT_RGBA
 	};
 
 	benchmark_result_t res = { 0 };
@@ -383,8 +397,8 @@ benchmark_result_t benchmark_image(const char* path, int runs, benchmark_conf co
 
 	void *encoded_qoi = qoi_encode(pixels, &desc, &encoded_qoi_size, &res.stats);
 
-	if (!pixels || !encoded_qoi || !encoded_png) {
-		QOI_ERROR("Error decoding %s\n", path);
+	if (!encoded_qoi) {
+		QOI_ERROR("Error encoding %s\n", path);
 	}
 
 	if (conf.saveQOI) {
@@ -414,7 +428,7 @@ benchmark_result_t benchmark_image(const char* path, int runs, benchmark_conf co
 	if (conf.decode) {
 		BENCHMARK_FN(abs(runs), res.qoi.decode_time, {
 			qoi_desc desc;
-			void* dec_p = qoi_decode(encoded_qoi, encoded_qoi_size, &desc, 4);
+			void* dec_p = qoi_decode_parallel(encoded_qoi, encoded_qoi_size, &desc, 4, conf.threads);
 			free(dec_p);
 			});
 	}
@@ -423,14 +437,14 @@ benchmark_result_t benchmark_image(const char* path, int runs, benchmark_conf co
 	if (runs > 0) {
 		BENCHMARK_FN(runs, res.libpng.encode_time, {
 			int enc_size;
-			void* enc_p = libpng_encode(pixels, w, h, &enc_size);
+			void* enc_p = libpng_encode(ref_pixels, w, h, &enc_size);
 			res.libpng.size = enc_size;
 			free(enc_p);
 			});
 
 		BENCHMARK_FN(runs, res.stbi.encode_time, {
 			int enc_size = 0;
-			stbi_write_png_to_func(stbi_write_callback, &enc_size, w, h, 4, pixels, 0);
+			stbi_write_png_to_func(stbi_write_callback, &enc_size, w, h, 4, ref_pixels, 0);
 			res.stbi.size = enc_size;
 			});
 	}
@@ -438,19 +452,15 @@ benchmark_result_t benchmark_image(const char* path, int runs, benchmark_conf co
 	if (conf.encode) {
 		BENCHMARK_FN(abs(runs), res.qoi.encode_time, {
 			int enc_size;
-			auto desc = qoi_desc{
-				.width = (unsigned int)w,
-				.height = (unsigned int)h,
-				.channels = 4,
-				.colorspace = QOI_SRGB,
-				.mode = 1
-			};
-			void* enc_p = qoi_encode(pixels, &desc, &enc_size, NULL);
+			void* enc_p = qoi_encode_parallel(pixels, &desc, &enc_size, NULL, conf.threads);
 			res.qoi.size = enc_size;
 			free(enc_p);
 			});
 	}
 
+	if (ref_pixels != pixels) {
+		free(ref_pixels);
+	}
 	free(pixels);
 	free(encoded_png);
 	free(encoded_qoi);
@@ -469,12 +479,12 @@ void benchmark_print_header(const char *head) {
 	for (int i = 0, S = 39 - (int)strlen(buff); i < S; ++i) printf(" ");
 
 	printf(
-		"|   index    diff_8    diff_16    run_8    diff_24    color  | size kB\n");
+		"|   index    diff_8    diff_16    run_8    diff_24    color      raw  | size kB\n");
 }
 
 void benchmark_print_separator() {
 	printf(
-		"---------------------------------------+------------------------------------------------------------+--------\n");
+		"---------------------------------------+---------------------------------------------------------------------+--------\n");
 }
 
 void benchmark_print_simple_result(const char* head, benchmark_result_t res) {
@@ -488,13 +498,14 @@ void benchmark_print_simple_result(const char* head, benchmark_result_t res) {
 	for (int i = 0, S = 39 - (int)strlen(buff); i < S; ++i) printf(" ");
 
 	printf(
-		"|%8d  %8d   %8d %8d   %8d %8d  |%8d\n",
+		"|%8d  %8d   %8d %8d   %8d %8d %8d  |%8d\n",
 		(int)res.stats.count_index,
 		(int)res.stats.count_diff_8,
 		(int)res.stats.count_diff_16,
 		(int)res.stats.count_run_8,
 		(int)res.stats.count_diff_24,
 		(int)res.stats.count_color,
+		(int)res.stats.count_raw,
 		(int)res.qoi.size / 1024
 	);
 }
@@ -538,8 +549,9 @@ void benchmark_print_result(const char *head, benchmark_result_t res, int runs)
 
 int main(int argc, char **argv) {
 	if (argc < 3) {
-		printf("Usage: qoibench <iterations> <directory>\n");
+		printf("Usage: qoibench <iterations> <directory> [threads]\n");
 		printf("Example: qoibench 10 images/textures/\n");
+		printf("Threads: 1 (default) encodes and decodes serially, 0 uses one thread per CPU\n");
 		exit(1);
 	}
 
@@ -592,9 +604,10 @@ int main(int argc, char **argv) {
 
 	benchmark_conf conf;
 	conf.encode = true;
-	conf.decode = false;
+	conf.decode = true;
 	conf.alphaToBW = true;
 	conf.saveQOI = true;
+	conf.threads = argc > 3 ? atoi(argv[3]) : 1;
 
 	for (auto& suite : dir_suites) {
 		if (suite.files.empty())
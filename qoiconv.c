@@ -4,7 +4,7 @@ Command line tool to convert between png <> qoi format
 
 Requires "stb_image.h" and "stb_image_write.h"
 Compile with: 
-	gcc qoiconv.c -std=c99 -O3 -o qoiconv
+	gcc qoiconv.c -std=c99 -lpthread -O3 -o qoiconv
 
 Dominic Szablewski - https://phoboslab.org
 
@@ -71,16 +71,6 @@ int main(int argc, char **argv) {
 		h = desc.height;
 	}
 
-	if (channels == 4) {
-		unsigned char* px_ptr = (unsigned char*)pixels;
-		for (int i = 0, S = w * h; i < S; ++i, px_ptr += 4) {
-			px_ptr[0] = px_ptr[3];
-			px_ptr[1] = px_ptr[3];
-			px_ptr[2] = px_ptr[3];
-			px_ptr[3] = 255;
-		}
-	}
-
 	if (pixels == NULL) {
 		printf("Couldn't load/decode %s\n", argv[1]);
 		exit(1);
@@ -97,7 +87,8 @@ int main(int argc, char **argv) {
 			.width = w,
 			.height = h, 
 			.channels = channels,
-			.colorspace = QOI_SRGB
+			.colorspace = QOI_SRGB,
+			.layout = channels == 4 ? QOI_LAYOUT_ALPHA : QOI_LAYOUT_RGBA
 		});
 
 		// Try decoding as well...